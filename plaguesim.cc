@@ -1,31 +1,87 @@
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <cstdlib>
+#include <cstring>
 #include <cmath>
+#include <cstdint>
+#include <cstdio>
 #include <fstream>
+#include <future>
 #include <iomanip>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
 #include <random>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #define MIN_ITERATIONS 30
 #define MAX_ITERATIONS 100
 #define MAX_TIME 10.0
+#define REPLICATION_BATCH 4
+#define BATCH_MAX_CORRELATION 0.2
+#define EXPONENTIAL_BATCH 256
+#define ZIGGURAT_R 7.697117470131487
+#define ZIGGURAT_V 3.949659822581572e-3
+#define EXACT_MAX_NODES 40
+#define TAU_SATURATION 20.0
+#define TAU_CHECK_MAX_POP 500
+#define CONTROL_VARIATES 3
+#define CONTROL_HORIZON 40.0
+#define CONTROL_PILOT 10
+#define REPLICATION_PLAIN 0
+#define REPLICATION_RECORD 1
+#define REPLICATION_CONTROL 2
+#define BENCH_TIME 10.0
+#define BENCH_SECONDS 0.5
+#define BENCH_DEGREE 8
+#define TRAJECTORY_MAGIC "PLAGTRJ1"
+#define TRAJECTORY_BUFFER (1 << 20)
+#define DENSE_MAX_NODES 32768
+#define GENERATOR_CHUNKS 256
+#define CHECKPOINT_MAGIC "PLAGCKP1"
+#define CHECKPOINT_SECONDS 30.0
+#define CACHE_MAGIC "PLAGCCH1"
+#define CACHE_DIRECTORY "plaguesim_cache"
+#define CSR_MAGIC "PLAGCSR1"
+#define CSR_HEADER_SIZE 24
+#define KIND_CSR 0
+#define KIND_CLIQUE 1
+#define KIND_STAR 2
+#define KIND_CIRCULAR 3
+#define KERNEL_KINDS 4
 
 using namespace std;
 
 unsigned seed = chrono::system_clock::now().time_since_epoch().count();
-mt19937 randomGen(seed);
 ofstream outputFile;
 
 struct Data {
-    int pop, minPop, maxPop, increment, type, mainParameter, infectionType;
-    bool set, run, hack;
-    double gamma, mu, C, confidence;
+    int pop, minPop, maxPop, increment, type, mainParameter, infectionType, engine, threads, estimator;
+    int trajectoryFormat, trajectoryDecimation, generator, graphDegree, varianceReduction;
+    unsigned seed, graphSeed;
+    bool set, run, hack, exact, profile, checkpoint, resultCache;
+    double gamma, mu, C, confidence, trajectoryInterval, tauTolerance, rewiring;
     string inputFileName, outputFileName;
 
     Data() {
         hack = false;
+        exact = false;
+        profile = false;
+        checkpoint = false;
+        resultCache = false;
         set = false;
         gamma = 1.1;
         mu = 1.0;
@@ -38,6 +94,19 @@ struct Data {
         type = 1;
         infectionType = 1;
         mainParameter = 1;
+        engine = 2;
+        threads = 1;
+        estimator = 1;
+        varianceReduction = 1;
+        trajectoryFormat = 1;
+        trajectoryInterval = 0.0;
+        tauTolerance = 0.03;
+        graphDegree = 4;
+        rewiring = 0.1;
+        graphSeed = 1;
+        trajectoryDecimation = 1;
+        generator = 2;
+        seed = 0;
         outputFileName = "dataout.csv";
         inputFileName = "adj.matrix";
     }
@@ -55,9 +124,32 @@ struct Data {
         else if (type == 4) {
             return "Custom";
         }
+        else if (type == 5) {
+            return "Erdos-Renyi";
+        }
+        else if (type == 6) {
+            return "Barabasi-Albert";
+        }
+        else if (type == 7) {
+            return "Watts-Strogatz";
+        }
+        else if (type == 8) {
+            return "Lattice";
+        }
         return "Error";
     }
 
+    // What, besides the type and size, tells two graphs apart.
+    string graphSettings() {
+        if (type == 4) {
+            return inputFileName;
+        }
+        if (type >= 5) {
+            return to_string(graphDegree) + " " + to_string(rewiring) + " " + to_string(graphSeed);
+        }
+        return "";
+    }
+
     string printMainParameter() {
         if (mainParameter == 1) {
             return "Gamma";
@@ -71,6 +163,78 @@ struct Data {
         return "Error";
     }
 
+    string printEngine() {
+        if (engine == 1) {
+            return "Full Scan";
+        }
+        else if (engine == 2) {
+            return "Incremental";
+        }
+        else if (engine == 4) {
+            return "Tau Leaping";
+        }
+        return "Error";
+    }
+
+    string printEstimator() {
+        if (estimator == 1) {
+            return "Final Snapshot";
+        }
+        else if (estimator == 2) {
+            return "Time Average";
+        }
+        return "Error";
+    }
+
+    string printVarianceReduction() {
+        if (varianceReduction == 1) {
+            return "None";
+        }
+        else if (varianceReduction == 2) {
+            return "Common Random Numbers";
+        }
+        else if (varianceReduction == 3) {
+            return "Control Variate";
+        }
+        else if (varianceReduction == 4) {
+            return "Common Random Numbers and Control Variate";
+        }
+        return "Error";
+    }
+
+    // With common random numbers, replication r of every population size
+    // and every sweep with the same seed runs on the same stream.
+    int streamPopulation(int population) const {
+        return (varianceReduction == 2 || varianceReduction == 4) ? 0 : population;
+    }
+
+    // Tau leaping has no single events to weigh, so it runs without.
+    bool controlVariate() const {
+        return (varianceReduction == 3 || varianceReduction == 4) && engine != 4;
+    }
+
+    string printGenerator() {
+        if (generator == 1) {
+            return "Mersenne Twister";
+        }
+        else if (generator == 2) {
+            return "xoshiro256++";
+        }
+        return "Error";
+    }
+
+    string printTrajectory() {
+        string format = (trajectoryFormat == 2) ? "Binary" : "Text";
+
+        if (trajectoryInterval > 0) {
+            return format + ", every " + to_string(trajectoryInterval) + " time units";
+        }
+        if (trajectoryDecimation > 1) {
+            return format + ", every " + to_string(trajectoryDecimation) + " events";
+        }
+        return format + ", every event";
+    }
+
     string printInfectionType() {
         if (infectionType == 1) {
             return "Multiplicative";
@@ -90,469 +254,3486 @@ struct Event {
     Event(int n, double t): node(n), eventTime(t) {};
 };
 
-struct Edge {
-    unsigned int dest;
-    int weight;
+// Tables of the 256-layer ziggurat for the unit exponential (Marsaglia and
+// Tsang, 2000), built once on first use.
+struct ExponentialZiggurat {
+    double k[256], w[256], f[256];
+
+    ExponentialZiggurat() {
+        const double m = 4294967296.0;
+        double d = ZIGGURAT_R, t = ZIGGURAT_R;
+        double q = ZIGGURAT_V / exp(-d);
+
+        k[0] = (d / q) * m;
+        k[1] = 0;
+        w[0] = q / m;
+        w[255] = d / m;
+        f[0] = 1.0;
+        f[255] = exp(-d);
+        for (int i = 254; i >= 1; i--) {
+            d = -log(ZIGGURAT_V / d + exp(-d));
+            k[i + 1] = (d / t) * m;
+            t = d;
+            f[i] = exp(-d);
+            w[i] = d / m;
+        }
+    }
 
-    Edge() {};
-    Edge(int d, int w): dest(d), weight(w) {};
+    static const ExponentialZiggurat& get() {
+        static const ExponentialZiggurat table;
+        return table;
+    }
 };
 
-struct Node {
-    int id, status;
-    vector<Edge> edge;
+// Random numbers for one replication. The generator is chosen at run time,
+// and exponential variates come from the ziggurat in batches of
+// EXPONENTIAL_BATCH, so almost no draw needs a log() and the tables stay
+// hot in cache while a batch is filled.
+struct RandomStream {
+    int kind;
+    mt19937_64 twister;
+    uint64_t state[4];
+    double batch[EXPONENTIAL_BATCH];
+    int used;
+
+    // Seeded from the master seed, the population size and the replication
+    // number, so results do not depend on which worker ran the replication
+    // or how many workers there were.
+    RandomStream(int generator, unsigned masterSeed, int pop, int replication): kind(generator), used(EXPONENTIAL_BATCH) {
+        seed_seq sequence = {masterSeed, (unsigned) pop, (unsigned) replication};
+        uint32_t words[8];
+
+        sequence.generate(words, words + 8);
+        if (kind == 2) {
+            for (int i = 0; i < 4; i++) {
+                state[i] = ((uint64_t) words[2*i] << 32) | words[2*i + 1];
+            }
+            if ((state[0] | state[1] | state[2] | state[3]) == 0) {
+                state[0] = 1;
+            }
+        }
+        else {
+            twister.seed(sequence);
+        }
+    }
+
+    static uint64_t rotl(uint64_t x, int k) {
+        return (x << k) | (x >> (64 - k));
+    }
+
+    uint64_t next64() {
+        if (kind != 2) {
+            return twister();
+        }
+
+        // xoshiro256++
+        uint64_t result = rotl(state[0] + state[3], 23) + state[0];
+        uint64_t t = state[1] << 17;
+
+        state[2] ^= state[0];
+        state[3] ^= state[1];
+        state[1] ^= state[2];
+        state[0] ^= state[3];
+        state[2] ^= t;
+        state[3] = rotl(state[3], 45);
+
+        return result;
+    }
+
+    // Lets the <random> distributions draw from the stream.
+    typedef uint64_t result_type;
+
+    static constexpr uint64_t min() {
+        return 0;
+    }
+
+    static constexpr uint64_t max() {
+        return UINT64_MAX;
+    }
+
+    uint64_t operator()() {
+        return next64();
+    }
+
+    long long binomial(long long trials, double p) {
+        if (trials <= 0 || p <= 0) {
+            return 0;
+        }
+        if (p >= 1) {
+            return trials;
+        }
+        binomial_distribution<long long> distribution(trials, p);
+        return distribution(*this);
+    }
+
+    // Uniform in (0, 1].
+    double uniform() {
+        return ((next64() >> 11) + 1) * (1.0 / 9007199254740992.0);
+    }
+
+    double zigguratExponential() {
+        const ExponentialZiggurat& z = ExponentialZiggurat::get();
+
+        while (true) {
+            uint64_t bits = next64();
+            int layer = bits & 255;
+            uint32_t value = bits >> 32;
+            double x = value * z.w[layer];
+
+            if (value < z.k[layer]) {
+                return x;
+            }
+            if (layer == 0) {
+                return ZIGGURAT_R - log(uniform());
+            }
+            if (z.f[layer] + uniform() * (z.f[layer - 1] - z.f[layer]) < exp(-x)) {
+                return x;
+            }
+        }
+    }
 
-    Node() {};
-    Node(int i, int s): id(i), status(s) {};
+    // Exponential variate with the given rate; infinite for a zero rate.
+    double exponential(double rate) {
+        if (rate <= 0) {
+            return INFINITY;
+        }
+        if (used == EXPONENTIAL_BATCH) {
+            for (int i = 0; i < EXPONENTIAL_BATCH; i++) {
+                batch[i] = zigguratExponential();
+            }
+            used = 0;
+        }
+        return batch[used++] / rate;
+    }
 };
 
-struct Graph {
-    vector<Node> node;
+// Sum tree over per-node infection rates. Leaves hold the rate of each
+// node, internal nodes the sum of their children, so updating one rate
+// and picking a node proportionally to its rate both cost O(log N).
+struct RateTree {
+    int size;
+    vector<double> sum;
 
-    Graph() {}
-    Graph(int n, Data parameters): node(vector<Node>(n)) {
-        for (int i = 0; i < n; i++) {
-            node[i] = Node(i, 0);
+    RateTree(): size(0) {};
+    RateTree(int n): size(1) {
+        while (size < n) {
+            size <<= 1;
         }
+        sum = vector<double>(2 * size, 0.0);
+    }
 
-        if (parameters.type == 1) {
-            for (int i = 0; i < n; i++) {
-                for (int j = 0; j < n; j++) {
-                    if (i != j) {
-                        node[i].edge.push_back(Edge(j, 1));
-                    }
-                }
+    void update(int i, double rate) {
+        int pos = i + size;
+
+        sum[pos] = rate;
+        for (pos >>= 1; pos >= 1; pos >>= 1) {
+            sum[pos] = sum[2*pos] + sum[2*pos + 1];
+        }
+    }
+
+    // Sets the first n leaves to the same rate and clears the rest.
+    void fill(int n, double rate) {
+        for (int i = 0; i < size; i++) {
+            sum[i + size] = (i < n) ? rate : 0.0;
+        }
+        for (int pos = size - 1; pos >= 1; pos--) {
+            sum[pos] = sum[2*pos] + sum[2*pos + 1];
+        }
+    }
+
+    double total() const {
+        return sum[1];
+    }
+
+    int find(double value) {
+        int pos = 1;
+
+        while (pos < size) {
+            if (value < sum[2*pos] || sum[2*pos + 1] <= 0) {
+                pos = 2*pos;
+            }
+            else {
+                value -= sum[2*pos];
+                pos = 2*pos + 1;
             }
         }
-        else if (parameters.type == 2) {
-            for (int i = 1; i < n; i++) {
-                node[0].edge.push_back(Edge(i, 1));
+
+        return pos - size;
+    }
+};
+
+// The contact network of one population size. It is built once and then
+// shared, read-only, by every replication and worker thread. Preset graphs
+// are implicit and compute their neighbors on the fly. Custom graphs are
+// stored in CSR form: the out-neighbors of node i are dest[offset[i]] up to
+// dest[offset[i+1] - 1], and weight is null when every edge weighs 1. The
+// arrays point either into the owned vectors or into a mapped binary file.
+struct Topology {
+    int n, type;
+    string error;
+    const unsigned int* offset;
+    const unsigned int* dest;
+    const int* weight;
+    vector<unsigned int> offsetData, destData;
+    vector<int> weightData;
+    // The nodes whose rate depends on a given node are its in-neighbors.
+    // This reverse CSR is only kept for directed custom graphs.
+    vector<unsigned int> inOffset, inDest;
+    vector<int> inWeight;
+    // Adjacency bit rows of unweighted Custom graphs with at least one
+    // neighbor per 64 nodes on average, rowWords words per node. Only the
+    // Full Scan engine reads them, so only its topologies have them.
+    vector<uint64_t> rows;
+    int rowWords;
+    void* mapped;
+    size_t mappedSize;
+
+    Topology(const Topology&) = delete;
+    Topology& operator=(const Topology&) = delete;
+
+    Topology(int size, Data& parameters): n(size), type(parameters.type), offset(NULL), dest(NULL), weight(NULL), rowWords(0), mapped(NULL), mappedSize(0) {
+        if (type == 4) {
+            string format = graphFileFormat(parameters.inputFileName);
+
+            if (format == "csr") {
+                loadBinary(parameters.inputFileName);
             }
-            for (int i = 1; i < n; i++) {
-                node[i].edge.push_back(Edge(0, 1));
+            else if (format == "edges") {
+                loadEdgeList(parameters.inputFileName);
+            }
+            else {
+                loadMatrix(parameters.inputFileName);
+            }
+            if (error.empty()) {
+                finishCSR();
             }
         }
-        else if (parameters.type == 3) {
-            for (int i = 0; i < n; i++) {
-                int prevNode = i-1;
-                if (prevNode < 0) {
-                    prevNode += n;
+        else if (type >= 5) {
+            generate(parameters);
+        }
+        if (type >= 4 && error.empty() && parameters.engine == 1) {
+            buildBitRows();
+        }
+    }
+
+    // A Custom graph built in memory instead of read from a file.
+    Topology(int size, const vector<unsigned int>& src, const vector<unsigned int>& dst, const vector<int>& w):
+            n(size), type(4), offset(NULL), dest(NULL), weight(NULL), rowWords(0), mapped(NULL), mappedSize(0) {
+        buildFromEdges(src, dst, w);
+        finishCSR();
+    }
+
+    ~Topology() {
+        if (mapped != NULL) {
+            munmap(mapped, mappedSize);
+        }
+    }
+
+    // Custom graph files are told apart by extension: ".edges" is a sparse
+    // edge list, ".csr" a binary CSR file, anything else a dense matrix.
+    static string graphFileFormat(const string& fileName) {
+        size_t dot = fileName.rfind('.');
+        string extension = (dot == string::npos) ? "" : fileName.substr(dot + 1);
+
+        if (extension == "csr" || extension == "edges") {
+            return extension;
+        }
+        return "matrix";
+    }
+
+    void useOwnedArrays() {
+        offset = offsetData.data();
+        dest = destData.data();
+        weight = weightData.empty() ? NULL : weightData.data();
+    }
+
+    void loadMatrix(const string& fileName) {
+        ifstream adjacencyMatrixFile;
+
+        adjacencyMatrixFile.open(fileName);
+        if (!adjacencyMatrixFile) {
+            error = "could not open " + fileName;
+            return;
+        }
+
+        offsetData.push_back(0);
+        for (int i = 0; i < n; i++) {
+            for (int j = 0; j < n; j++) {
+                int w;
+
+                if (!(adjacencyMatrixFile >> w)) {
+                    error = fileName + " does not hold a " + to_string(n) + "x" + to_string(n) + " matrix";
+                    return;
+                }
+                if (w != 0) {
+                    destData.push_back(j);
+                    weightData.push_back(w);
                 }
+            }
+            offsetData.push_back(destData.size());
+        }
+        adjacencyMatrixFile.close();
+
+        useOwnedArrays();
+    }
+
+    // One "src dst [weight]" entry per line, the same as setting A[src][dst]
+    // in the matrix format. Blank lines and lines starting with # are skipped.
+    void loadEdgeList(const string& fileName) {
+        ifstream edgeListFile;
+        string line;
+        int lineNumber = 0;
+        vector<unsigned int> src;
+        vector<unsigned int> dst;
+        vector<int> w;
+
+        edgeListFile.open(fileName);
+        if (!edgeListFile) {
+            error = "could not open " + fileName;
+            return;
+        }
+
+        while (getline(edgeListFile, line)) {
+            const char* cur = line.c_str();
+            char* end;
+            long fields[3] = {0, 0, 1};
+            int nFields = 0;
 
-                int nextNode = i+1;
-                if (nextNode == n) {
-                    nextNode = 0;
+            lineNumber++;
+            while (nFields < 3) {
+                long value = strtol(cur, &end, 10);
+                if (end == cur) {
+                    break;
                 }
+                fields[nFields++] = value;
+                cur = end;
+            }
+            while (*cur == ' ' || *cur == '\t' || *cur == '\r') {
+                cur++;
+            }
+
+            if (nFields == 0 && (*cur == '\0' || *cur == '#')) {
+                continue;
+            }
+            if (nFields < 2 || (*cur != '\0' && *cur != '#')) {
+                error = fileName + ":" + to_string(lineNumber) + ": expected \"src dst [weight]\"";
+                return;
+            }
+            if (fields[0] < 0 || fields[0] >= n || fields[1] < 0 || fields[1] >= n) {
+                error = fileName + ":" + to_string(lineNumber) + ": node id out of range for population " + to_string(n);
+                return;
+            }
+            if (fields[2] != 0) {
+                src.push_back(fields[0]);
+                dst.push_back(fields[1]);
+                w.push_back(fields[2]);
+            }
+        }
+        edgeListFile.close();
+
+        buildFromEdges(src, dst, w);
+    }
+
+    // Builds the CSR arrays from a list of src -> dst entries of weight w.
+    void buildFromEdges(const vector<unsigned int>& src, const vector<unsigned int>& dst, const vector<int>& w) {
+        offsetData.assign(n + 1, 0);
+        for (auto i : src) {
+            offsetData[i + 1]++;
+        }
+        for (int i = 0; i < n; i++) {
+            offsetData[i + 1] += offsetData[i];
+        }
+
+        vector<unsigned int> next(offsetData.begin(), offsetData.end() - 1);
+        destData.resize(src.size());
+        weightData.resize(src.size());
+        for (unsigned int k = 0; k < src.size(); k++) {
+            unsigned int pos = next[src[k]]++;
+
+            destData[pos] = dst[k];
+            weightData[pos] = w[k];
+        }
+
+        // Sort each row by destination, as the matrix format would give.
+        vector<pair<unsigned int, int> > row;
+        for (int i = 0; i < n; i++) {
+            row.clear();
+            for (unsigned int k = offsetData[i]; k < offsetData[i + 1]; k++) {
+                row.push_back(make_pair(destData[k], weightData[k]));
+            }
+            sort(row.begin(), row.end());
+            for (unsigned int k = 0; k < row.size(); k++) {
+                destData[offsetData[i] + k] = row[k].first;
+                weightData[offsetData[i] + k] = row[k].second;
+            }
+        }
+
+        useOwnedArrays();
+    }
+
+    // Binary CSR, native byte order, mapped and used in place:
+    //   char[8] "PLAGCSR1", uint32 n, uint32 flags (1 = weighted), uint64 nnz,
+    //   uint32 offset[n+1], uint32 dest[nnz], then int32 weight[nnz] if weighted.
+    void loadBinary(const string& fileName) {
+        int fd = open(fileName.c_str(), O_RDONLY);
+        struct stat info;
+
+        if (fd < 0 || fstat(fd, &info) != 0) {
+            error = "could not open " + fileName;
+            if (fd >= 0) {
+                close(fd);
+            }
+            return;
+        }
+
+        mappedSize = info.st_size;
+        if (mappedSize >= CSR_HEADER_SIZE) {
+            mapped = mmap(NULL, mappedSize, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped == MAP_FAILED) {
+                mapped = NULL;
+            }
+        }
+        close(fd);
+        if (mapped == NULL) {
+            error = fileName + " is not a binary CSR file";
+            return;
+        }
+
+        const char* base = (const char*) mapped;
+        unsigned int fileN, flags;
+        unsigned long long nnz;
+
+        memcpy(&fileN, base + 8, 4);
+        memcpy(&flags, base + 12, 4);
+        memcpy(&nnz, base + 16, 8);
+        if (memcmp(base, CSR_MAGIC, 8) != 0) {
+            error = fileName + " is not a binary CSR file";
+            return;
+        }
+        if ((int) fileN != n) {
+            error = fileName + " holds " + to_string(fileN) + " nodes, but the population is " + to_string(n);
+            return;
+        }
+
+        size_t expected = CSR_HEADER_SIZE + 4 * (n + 1) + 4 * nnz * ((flags & 1) ? 2 : 1);
+        if (mappedSize != expected) {
+            error = fileName + " is truncated or has trailing data";
+            return;
+        }
+
+        offset = (const unsigned int*) (base + CSR_HEADER_SIZE);
+        dest = offset + n + 1;
+        weight = (flags & 1) ? (const int*) (dest + nnz) : NULL;
+
+        if (offset[0] != 0 || offset[n] != nnz) {
+            error = fileName + " has inconsistent row offsets";
+            return;
+        }
+        for (int i = 0; i < n; i++) {
+            if (offset[i] > offset[i + 1]) {
+                error = fileName + " has inconsistent row offsets";
+                return;
+            }
+        }
+        for (unsigned long long k = 0; k < nnz; k++) {
+            if (dest[k] >= (unsigned int) n) {
+                error = fileName + ": node id out of range for population " + to_string(n);
+                return;
+            }
+        }
+    }
+
+    bool saveBinary(const string& fileName) const {
+        ofstream csrFile(fileName, ios::binary);
+        unsigned int fileN = n;
+        unsigned int flags = (weight != NULL) ? 1 : 0;
+        unsigned long long nnz = offset[n];
 
-                node[i].edge.push_back(Edge(prevNode, 1));
-                node[i].edge.push_back(Edge(nextNode, 1));
+        csrFile.write(CSR_MAGIC, 8);
+        csrFile.write((const char*) &fileN, 4);
+        csrFile.write((const char*) &flags, 4);
+        csrFile.write((const char*) &nnz, 8);
+        csrFile.write((const char*) offset, 4 * (n + 1));
+        csrFile.write((const char*) dest, 4 * nnz);
+        if (weight != NULL) {
+            csrFile.write((const char*) weight, 4 * nnz);
+        }
+
+        return (bool) csrFile;
+    }
+
+    // Drops unit weights and builds the reverse CSR of directed graphs.
+    void finishCSR() {
+        unsigned int nnz = offset[n];
+
+        if (weight != NULL && all_of(weight, weight + nnz, [](int w) { return w == 1; })) {
+            weight = NULL;
+            weightData.clear();
+        }
+
+        inOffset.assign(n + 1, 0);
+        for (unsigned int k = 0; k < nnz; k++) {
+            inOffset[dest[k] + 1]++;
+        }
+        for (int i = 0; i < n; i++) {
+            inOffset[i + 1] += inOffset[i];
+        }
+
+        vector<unsigned int> next(inOffset.begin(), inOffset.end() - 1);
+        inDest.resize(nnz);
+        if (weight != NULL) {
+            inWeight.resize(nnz);
+        }
+        for (int i = 0; i < n; i++) {
+            for (unsigned int k = offset[i]; k < offset[i + 1]; k++) {
+                unsigned int pos = next[dest[k]]++;
+
+                inDest[pos] = i;
+                if (weight != NULL) {
+                    inWeight[pos] = weight[k];
+                }
             }
         }
-        else if (parameters.type == 4) {
-            ifstream adjacencyMatrixFile;
 
-            adjacencyMatrixFile.open(parameters.inputFileName);
+        // Rows come out sorted on both sides, so a symmetric matrix gives
+        // back exactly the forward arrays.
+        if (equal(inOffset.begin(), inOffset.end(), offset) && equal(inDest.begin(), inDest.end(), dest) &&
+                (weight == NULL || equal(inWeight.begin(), inWeight.end(), weight))) {
+            inOffset.clear();
+            inDest.clear();
+            inWeight.clear();
+        }
+    }
+
+    void buildBitRows() {
+        unsigned int nnz = offset[n];
+
+        if (weight == NULL && n <= DENSE_MAX_NODES && (long long) nnz * 64 >= (long long) n * n) {
+            rowWords = (n + 63) / 64;
+            rows.assign((size_t) n * rowWords, 0);
             for (int i = 0; i < n; i++) {
-                for (int j = 0; j < n; j++) {
-                    int weight;
+                for (unsigned int k = offset[i]; k < offset[i + 1]; k++) {
+                    uint64_t& word = rows[(size_t) i * rowWords + dest[k] / 64];
+                    uint64_t bit = (uint64_t) 1 << (dest[k] % 64);
 
-                    adjacencyMatrixFile >> weight;
-                    if (weight != 0) {
-                        node[i].edge.push_back(Edge(j, weight));
+                    // Parallel edges would be lost in a bit row.
+                    if (word & bit) {
+                        rows.clear();
+                        rowWords = 0;
+                        return;
                     }
+                    word |= bit;
                 }
             }
-            adjacencyMatrixFile.close();
         }
     }
 
-    /*void printAdjacencyMatrix() {
-        for (unsigned int i = 0; i < node.size(); i++) {
-            unsigned int cur = 0;
-            for (unsigned int j = 0; j < node.size(); j++) {
-                if (cur < node[i].edge.size() && node[i].edge[cur].dest == j) {
-                    cout << "1 ";
-                    cur++;
-                }
-                else {
-                    cout << "0 ";
-                }
+    // Runs work(chunk) for chunks 0 to count - 1 on up to threads threads.
+    // Each chunk draws from its own stream, so the graph does not depend on
+    // the number of threads.
+    template <typename Work>
+    static void forEachChunk(int count, int threads, Work work) {
+        atomic<int> next(0);
+        vector<thread> workers;
+        auto run = [&]() {
+            for (int chunk = next++; chunk < count; chunk = next++) {
+                work(chunk);
             }
-            cout << endl;
+        };
+
+        for (int t = 1; t < min(threads, count); t++) {
+            workers.push_back(thread(run));
         }
-    }*/
+        run();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
 
-    Event findNextInfection(Data parameters) {
-        Event infection(-1, 0);
-        double lambda = parameters.C / node.size();
+    // Generated graphs, built in memory from graphSeed:
+    //   5. Erdos-Renyi G(n, p), with mean degree graphDegree.
+    //   6. Barabasi-Albert, each new node attaching to graphDegree / 2
+    //      existing ones with probability proportional to their degree.
+    //   7. Watts-Strogatz, a ring where each node links to its graphDegree
+    //      nearest neighbors, each edge rewired with probability rewiring.
+    //   8. A 2-D lattice of width sqrt(n) with helical periodic boundaries,
+    //      node i linked to i + 1 and i + width (mod n).
+    // Streams use negative replication numbers, apart from the simulation's.
+    void generate(Data& parameters) {
+        int chunks = min(n, GENERATOR_CHUNKS);
+        int threads = max(1, parameters.threads);
+        vector<vector<unsigned int> > edges(max(chunks, 1));
+        auto firstNode = [&](int chunk) {
+            return (int) ((long long) n * chunk / chunks);
+        };
+
+        if (type == 5) {
+            double p = min(1.0, (double) parameters.graphDegree / max(n - 1, 1));
 
-        for (unsigned int curNode = 0; curNode < node.size(); curNode++) {
-            double infTime;
-            double ratio = lambda;
+            // Batagelj-Brandes: jump straight to the next pair that gets an
+            // edge, with geometrically distributed gaps.
+            forEachChunk(chunks, threads, [&](int chunk) {
+                RandomStream rng(2, parameters.graphSeed, n, -1 - chunk);
+                double logMiss = log1p(-p);
 
-            if (node[curNode].status == 0) {
-                for (unsigned int neighbor = 0; neighbor < node[curNode].edge.size(); neighbor++) {
-                    if (node[node[curNode].edge[neighbor].dest].status == 1) {
-                        if (parameters.infectionType == 1) {
-                            ratio *= parameters.gamma * node[curNode].edge[neighbor].weight;
+                for (int u = firstNode(chunk); u < firstNode(chunk + 1); u++) {
+                    for (long long v = u + 1; v < n; v++) {
+                        if (p < 1.0) {
+                            v += (long long) min(floor(log(rng.uniform()) / logMiss), (double) n);
                         }
-                        else if (parameters.infectionType == 2) {
-                            ratio += parameters.gamma * node[curNode].edge[neighbor].weight;
+                        if (v < n) {
+                            edges[chunk].push_back(u);
+                            edges[chunk].push_back(v);
                         }
                     }
                 }
+            });
+        }
+        // Preferential attachment is sequential by nature, so only the CSR
+        // is built in parallel.
+        else if (type == 6) {
+            int m = max(1, parameters.graphDegree / 2);
+            int seedNodes = min(n, m + 1);
+            RandomStream rng(2, parameters.graphSeed, n, -1);
+            vector<unsigned int>& list = edges[0];
+            vector<unsigned int> targets;
 
-                exponential_distribution<double> infectionTime(ratio);
-                infTime = infectionTime(randomGen);
+            for (int u = 0; u < seedNodes; u++) {
+                for (int v = u + 1; v < seedNodes; v++) {
+                    list.push_back(u);
+                    list.push_back(v);
+                }
+            }
+            // Every edge is in the list with both ends, so a uniform entry
+            // picks a node with probability proportional to its degree.
+            for (int u = seedNodes; u < n; u++) {
+                targets.clear();
+                while ((int) targets.size() < m) {
+                    unsigned int v = list[rng.next64() % list.size()];
 
-                if (infection.node == -1 || infection.eventTime > infTime) {
-                    infection = Event(curNode, infTime);
+                    if (find(targets.begin(), targets.end(), v) == targets.end()) {
+                        targets.push_back(v);
+                    }
+                }
+                for (auto v : targets) {
+                    list.push_back(u);
+                    list.push_back(v);
                 }
             }
         }
+        else if (type == 7) {
+            int half = max(1, min(parameters.graphDegree / 2, (n - 1) / 2));
 
-        return infection;
-    }
-};
+            forEachChunk(chunks, threads, [&](int chunk) {
+                RandomStream rng(2, parameters.graphSeed, n, -1 - chunk);
 
-Data runUI(Data oldParam) {
-    char option = 'x';
-    Data newParam;
+                for (int u = firstNode(chunk); u < firstNode(chunk + 1); u++) {
+                    for (int j = 1; j <= half && n > 1; j++) {
+                        unsigned int v = (u + j) % n;
 
-    if (oldParam.set == true) {
-        newParam = oldParam;
+                        if (rng.uniform() <= parameters.rewiring) {
+                            do {
+                                v = rng.next64() % n;
+                            } while ((int) v == u);
+                        }
+                        edges[chunk].push_back(u);
+                        edges[chunk].push_back(v);
+                    }
+                }
+            });
+        }
+        else if (type == 8) {
+            int width = max(1, (int) round(sqrt((double) n)));
+
+            forEachChunk(chunks, threads, [&](int chunk) {
+                for (int u = firstNode(chunk); u < firstNode(chunk + 1); u++) {
+                    edges[chunk].push_back(u);
+                    edges[chunk].push_back((u + 1) % n);
+                    edges[chunk].push_back(u);
+                    edges[chunk].push_back((u + width) % n);
+                }
+            });
+        }
+
+        buildUndirected(edges, threads);
     }
-    newParam.set = true;
-    newParam.run = false;
 
-    while (option != 'R' && option != 'r') {
-        cout << "--------------------------------------" << endl;
-        cout << "|        Welcome to PlagueSim        |" << endl;
-        cout << "--------------------------------------" << endl;
-        cout << endl << "RATES:" << endl;
-        cout << "[E]ndogenous Infection Rate = " << newParam.gamma << endl;
-        cout << "[T]otal Exogenous Infection Rate = " << newParam.C << endl;
-        cout << "[H]ealing Rate = " << newParam.mu << endl;
-        cout << endl << "GRAPH SETTINGS:" << endl;
-        if (newParam.type != 4) {
-            cout << "[S]tarting Population = " << newParam.minPop << endl;
-            cout << "[M]aximum Population = " << newParam.maxPop << endl;
-            cout << "[J]ump = " << newParam.increment << endl;
+    // CSR from undirected edges given as node pairs. Rows are filled through
+    // atomic cursors, then sorted, which fixes their order. Self loops and
+    // repeated edges (from small graphs or rewiring) are dropped.
+    void buildUndirected(vector<vector<unsigned int> >& edges, int threads) {
+        int chunks = edges.size();
+        int rowChunks = min(max(n, 1), GENERATOR_CHUNKS);
+        vector<atomic<unsigned int> > cursor(n);
+        vector<unsigned int> length(n);
+        auto firstNode = [&](int chunk) {
+            return (int) ((long long) n * chunk / rowChunks);
+        };
+
+        forEachChunk(chunks, threads, [&](int chunk) {
+            for (unsigned int k = 0; k < edges[chunk].size(); k += 2) {
+                if (edges[chunk][k] != edges[chunk][k + 1]) {
+                    cursor[edges[chunk][k]]++;
+                    cursor[edges[chunk][k + 1]]++;
+                }
+            }
+        });
+
+        offsetData.assign(n + 1, 0);
+        for (int i = 0; i < n; i++) {
+            offsetData[i + 1] = offsetData[i] + cursor[i];
+            cursor[i] = offsetData[i];
+        }
+        destData.resize(offsetData[n]);
+
+        forEachChunk(chunks, threads, [&](int chunk) {
+            for (unsigned int k = 0; k < edges[chunk].size(); k += 2) {
+                unsigned int u = edges[chunk][k], v = edges[chunk][k + 1];
+
+                if (u != v) {
+                    destData[cursor[u]++] = v;
+                    destData[cursor[v]++] = u;
+                }
+            }
+            vector<unsigned int>().swap(edges[chunk]);
+        });
+
+        forEachChunk(rowChunks, threads, [&](int chunk) {
+            for (int i = firstNode(chunk); i < firstNode(chunk + 1); i++) {
+                auto row = destData.begin() + offsetData[i];
+                auto rowEnd = destData.begin() + offsetData[i + 1];
+
+                sort(row, rowEnd);
+                length[i] = unique(row, rowEnd) - row;
+            }
+        });
+
+        // Close the gaps left by repeated edges.
+        unsigned int kept = 0;
+        for (int i = 0; i < n; i++) {
+            unsigned int first = offsetData[i];
+
+            offsetData[i] = kept;
+            if (kept != first) {
+                copy(destData.begin() + first, destData.begin() + first + length[i], destData.begin() + kept);
+            }
+            kept += length[i];
+        }
+        offsetData[n] = kept;
+        destData.resize(kept);
+        destData.shrink_to_fit();
+
+        useOwnedArrays();
+    }
+
+    // Dense graphs count infected neighbors with bit operations instead of
+    // visiting them. The Clique needs no rows, every other node is adjacent.
+    bool dense() const {
+        return type == 1 || !rows.empty();
+    }
+
+    int size() const {
+        return n;
+    }
+
+    // The most neighbors a node's rate can depend on.
+    int maxDegree() const {
+        int degree = 0;
+
+        if (type == 1 || type == 2) {
+            return n - 1;
+        }
+        if (type == 3) {
+            return min(n - 1, 2);
+        }
+        for (int i = 0; i < n; i++) {
+            degree = max(degree, (int) (offset[i + 1] - offset[i]));
+        }
+        for (int i = 0; i + 1 < (int) inOffset.size(); i++) {
+            degree = max(degree, (int) (inOffset[i + 1] - inOffset[i]));
+        }
+        return degree;
+    }
+
+    // How the simulation kernels walk the neighbors of a node. Every graph
+    // read from a file or generated is stored as CSR.
+    int kind() const {
+        return type <= KIND_CIRCULAR ? type : KIND_CSR;
+    }
+
+    // Kind is a constant in every kernel, so only one branch is compiled in.
+    template <int Kind, typename Visit>
+    void forEachNeighborOf(int i, Visit visit) const {
+        if (Kind == KIND_CLIQUE) {
+            for (int j = 0; j < n; j++) {
+                if (j != i) {
+                    visit(j, 1);
+                }
+            }
+        }
+        else if (Kind == KIND_STAR) {
+            if (i == 0) {
+                for (int j = 1; j < n; j++) {
+                    visit(j, 1);
+                }
+            }
+            else {
+                visit(0, 1);
+            }
+        }
+        else if (Kind == KIND_CIRCULAR) {
+            int prevNode = i-1;
+            if (prevNode < 0) {
+                prevNode += n;
+            }
+
+            int nextNode = i+1;
+            if (nextNode == n) {
+                nextNode = 0;
+            }
+
+            visit(prevNode, 1);
+            visit(nextNode, 1);
         }
         else {
-            cout << "[A]djacency Matrix File = " << newParam.inputFileName << endl;
-            cout << "Popu[L]ation = " << newParam.pop << endl;
+            for (unsigned int k = offset[i]; k < offset[i + 1]; k++) {
+                visit(dest[k], weight == NULL ? 1 : weight[k]);
+            }
         }
-        cout << endl << "SIMULATOR SETTINGS:" << endl;
-        cout << "[G]raph Type = " << newParam.printGraphType() << endl;
-        cout << "[I]nfection Type = " << newParam.printInfectionType() << endl;
-        cout << "[C]onfidence Interval = " << newParam.confidence << endl;
-        cout << "[O]utput File = " << newParam.outputFileName << endl;
-        cout << "[P]rint Parameter = " << newParam.printMainParameter() << endl;
-        cout << endl << "ACTIONS:" << endl;
-        cout << "[R]un the Simulation" << endl;
-        cout << "E[X]it PlagueSim." << endl << endl;
+    }
 
-        cout << "Select an option: ";
-        cin >> option;
+    template <int Kind, typename Visit>
+    void forEachDependentOf(int i, Visit visit) const {
+        if (Kind != KIND_CSR || inOffset.empty()) {
+            forEachNeighborOf<Kind>(i, visit);
+            return;
+        }
+        for (unsigned int k = inOffset[i]; k < inOffset[i + 1]; k++) {
+            visit(inDest[k], inWeight.empty() ? 1 : inWeight[k]);
+        }
+    }
 
-        switch (option) {
-            case '@':
-                cout << "YOU ARE HACK!" << endl;
-                newParam.hack = true;
-                break;
-            case 'E':
-            case 'e':
-                cout << "This is the rate that nodes infect each other." << endl;
-                cout << "Please set a new value for Endogenous Infection: ";
-                cin >> newParam.gamma;
-                break;
-            case 'T':
-            case 't':
-                cout << "This is the total rate that nodes get infected." << endl;
-                cout << "Node infection rate will be this value divided by the population." << endl;
-                cout << "Please set a new value for the Exogenous Infection: ";
-                cin >> newParam.C;
-                break;
-            case 'H':
-            case 'h':
-                cout << "This is the rate that nodes heal themselves from infection." << endl;
-                cout << "Please set a new value for the Healing Rate: ";
-                cin >> newParam.mu;
-                break;
-            case 'S':
-            case 's':
-                cout << "Starting Population is the smallest population size that will be simulated." << endl;
-                cout << "Please set a new value for the Starting Population: ";
-                cin >> newParam.minPop;
+    template <typename Visit>
+    void forEachNeighbor(int i, Visit visit) const {
+        switch (kind()) {
+            case KIND_CLIQUE:
+                forEachNeighborOf<KIND_CLIQUE>(i, visit);
                 break;
-            case 'M':
-            case 'm':
-                cout << "Maximum Population is the largest population size that will be simulated." << endl;
-                cout << "Please set a new value for the Maximum Population: ";
-                cin >> newParam.maxPop;
-                break;
-            case 'J':
-            case 'j':
-                cout << "Increment will increase the population size until Maximum Population." << endl;
-                cout << "Smaller values of increment means a smoother graph, but take longer to simulate." << endl;
-                cout << "Please set a new Increment value: ";
-                cin >> newParam.increment;
-                break;
-            case 'A':
-            case 'a':
-                cout << "Please select the file containing the adjacency matrix for your graph: ";
-                cin >> newParam.inputFileName;
+            case KIND_STAR:
+                forEachNeighborOf<KIND_STAR>(i, visit);
                 break;
-            case 'L':
-            case 'l':
-                cout << "Note your adjacency matrix must fit the selected size." << endl;
-                cout << "Please select your population size: ";
-                cin >> newParam.pop;
+            case KIND_CIRCULAR:
+                forEachNeighborOf<KIND_CIRCULAR>(i, visit);
                 break;
-            case 'G':
-            case 'g':
-                cout << "[1]. Clique" << endl;
-                cout << "[2]. Star" << endl;
-                cout << "[3]. Circular" << endl; 
-                cout << "[4]. Custom (requires adjacency matrix file)" << endl;
-                cout << "Please select a preset graph type for the simulation: ";
-                cin >> newParam.type;
-                if (newParam.type < 1 || newParam.type > 4) {
-                    cout << "Invalid Graph type. Setting to default type: Clique." << endl;
-                    newParam.type = 1;
+            default:
+                forEachNeighborOf<KIND_CSR>(i, visit);
+        }
+    }
+
+    /*void printAdjacencyMatrix() {
+        for (int i = 0; i < n; i++) {
+            vector<int> row(n, 0);
+            forEachNeighbor(i, [&](int j, int w) { row[j] = w; });
+            for (int j = 0; j < n; j++) {
+                cout << row[j] << " ";
+            }
+            cout << endl;
+        }
+    }*/
+};
+
+// The state of one replication over a shared Topology. Each worker keeps a
+// single Graph and resets it between replications.
+struct Graph {
+    const Topology* topology;
+    vector<char> status;
+    int infectedTotal;
+
+    // Incremental engine state. infectedWeight is the product (Multiplicative)
+    // or the sum (Additive) of the weights of each node's infected neighbors.
+    bool incremental;
+    vector<int> infectedNeighbors;
+    vector<double> infectedWeight;
+    RateTree infectionRate;
+
+    // On the Clique every susceptible node has the same rate, so the
+    // incremental engine keeps only the list of them, in any order, and the
+    // place of each node in it.
+    vector<int> susceptible, slot;
+
+    // The status again as one bit per node, for dense topologies.
+    vector<uint64_t> infectedBits;
+
+    // gamma^k up to the topology's largest degree, rebuilt only when gamma
+    // changes.
+    vector<double> power;
+    double powerGamma;
+
+    Graph(const Topology& t): topology(&t), infectedTotal(0), incremental(false), powerGamma(0.0) {}
+
+    int size() const {
+        return status.size();
+    }
+
+    // Every node starts susceptible, so all rates start at lambda.
+    void reset(Data& parameters) {
+        int n = topology->size();
+
+        status.assign(n, 0);
+        infectedTotal = 0;
+        infectedBits.assign((n + 63) / 64, 0);
+        if (power.empty() || powerGamma != parameters.gamma) {
+            power.resize(topology->maxDegree() + 1);
+            for (int k = 0; k < (int) power.size(); k++) {
+                power[k] = pow(parameters.gamma, k);
+            }
+            powerGamma = parameters.gamma;
+        }
+
+        incremental = (parameters.engine != 1);
+        if (!incremental) {
+            return;
+        }
+
+        if (topology->kind() == KIND_CLIQUE) {
+            susceptible.resize(n);
+            slot.resize(n);
+            for (int i = 0; i < n; i++) {
+                susceptible[i] = i;
+                slot[i] = i;
+            }
+            return;
+        }
+
+        infectedNeighbors.assign(n, 0);
+        infectedWeight.assign(n, parameters.infectionType == 1 ? 1.0 : 0.0);
+        if (infectionRate.size < n) {
+            infectionRate = RateTree(n);
+        }
+        infectionRate.fill(n, parameters.C / n);
+    }
+
+    double gammaPower(int k) const {
+        return k < (int) power.size() ? power[k] : pow(powerGamma, k);
+    }
+
+    int infectedNeighborCount(int i) const {
+        int k = 0;
+        const uint64_t* row = &topology->rows[(size_t) i * topology->rowWords];
+        for (int w = 0; w < topology->rowWords; w++) {
+            k += __builtin_popcountll(row[w] & infectedBits[w]);
+        }
+        return k;
+    }
+
+    template <int Kind, int Infection>
+    Event findNextInfectionOf(Data& parameters, RandomStream& rng) {
+        Event infection(-1, 0);
+        double lambda = parameters.C / size();
+
+        if (Kind == KIND_CLIQUE || (Kind == KIND_CSR && topology->dense())) {
+            return findNextDenseInfection<Kind, Infection>(parameters, rng);
+        }
+
+        for (int curNode = 0; curNode < size(); curNode++) {
+            if (status[curNode] == 0) {
+                double infTime = rng.exponential(sparseRateOf<Kind, Infection>(curNode, lambda, parameters));
+
+                if (infection.node == -1 || infection.eventTime > infTime) {
+                    infection = Event(curNode, infTime);
                 }
-                break;
-            case 'I':
-            case 'i':
-                cout << "[1]. Multiplicative" << endl;
-                cout << "[2]. Additive" << endl;
-                cout << "Please select how endogenous infection will be modeled: ";
-                cin >> newParam.infectionType;
-                if (newParam.infectionType < 1 || newParam.infectionType > 2) {
-                    cout << "Invalid Infection type. Setting to default: Multiplicative." << endl;
-                    newParam.infectionType = 1;
+            }
+        }
+
+        return infection;
+    }
+
+    // findNextInfection over unit weights, where a node's rate only
+    // depends on how many of its neighbors are infected.
+    template <int Kind, int Infection>
+    Event findNextDenseInfection(Data& parameters, RandomStream& rng) {
+        Event infection(-1, 0);
+        double lambda = parameters.C / size();
+
+        for (int curNode = 0; curNode < size(); curNode++) {
+            if (status[curNode] == 0) {
+                double infTime = rng.exponential(denseRateOf<Kind, Infection>(curNode, lambda, parameters));
+
+                if (infection.node == -1 || infection.eventTime > infTime) {
+                    infection = Event(curNode, infTime);
                 }
-                break;
-            case 'C':
-            case 'c':
-                cout << "Lower values have better accuracy, but take longer to simulate." << endl;
-                cout << "Please set a new Confidence Interval: ";
-                cin >> newParam.confidence;
-                break;
-            case 'O':
-            case 'o':
-                cout << "Please set where to save output for graph making: ";
-                cin >> newParam.outputFileName;
-                break;
-            case 'P':
-            case 'p':
-                cout << "[1]. Endogenous Infection Rate" << endl;
-                cout << "[2]. Healing Rate" << endl;
-                cout << "[3]. Total Exogenous Infection Rate" << endl;
-                cout << "Please choose which parameter you are interested in: ";
-                cin >> newParam.mainParameter;
-                if (newParam.mainParameter < 1 || newParam.mainParameter > 3) {
-                    cout << "Invalid parameter. Setting to default: Endogenous Infection Rate" << endl;
-                    newParam.mainParameter = 1;
+            }
+        }
+
+        return infection;
+    }
+
+    // The rate of a node from the status of its neighbors, for the full scan.
+    template <int Kind, int Infection>
+    double sparseRateOf(int i, double lambda, Data& parameters) const {
+        double ratio = lambda;
+
+        topology->forEachNeighborOf<Kind>(i, [&](int dest, int weight) {
+            if (status[dest] == 1) {
+                if (Infection == 1) {
+                    ratio *= parameters.gamma * weight;
                 }
-                break;
-            case 'R':
-            case 'r':
-                cout << "The simulation will start now." << endl;
-                newParam.run = true;
-                break;
-            case 'X':
-            case 'x':
-                cout << "Closing application..." << endl;
-                option = 'R';
-                break;
-            default:
-                cout << "Invalid command." << endl;
+                else {
+                    ratio += parameters.gamma * weight;
+                }
+            }
+        });
+
+        return ratio;
+    }
+
+    template <int Kind, int Infection>
+    double denseRateOf(int i, double lambda, Data& parameters) const {
+        // On the Clique every infected node is a neighbor.
+        int k = (Kind == KIND_CLIQUE) ? infectedTotal : infectedNeighborCount(i);
+
+        return (Infection == 1) ? lambda * gammaPower(k) : lambda + parameters.gamma * k;
+    }
+
+    // The sum of the infection rates of the susceptible nodes. Only the
+    // incremental engine keeps it at hand, the full scan adds it up.
+    template <int Kind, int Infection>
+    double totalInfectionRateOf(Data& parameters) const {
+        double lambda = parameters.C / size();
+        double total = 0.0;
+
+        if (Kind == KIND_CLIQUE) {
+            return (size() - infectedTotal) * denseRateOf<Kind, Infection>(0, lambda, parameters);
         }
-        cout << endl;
+        if (incremental) {
+            return infectionRate.total();
+        }
+        for (int i = 0; i < size(); i++) {
+            if (status[i] == 0) {
+                total += topology->dense() ? denseRateOf<Kind, Infection>(i, lambda, parameters) : sparseRateOf<Kind, Infection>(i, lambda, parameters);
+            }
+        }
+        return total;
+    }
+
+    double nodeRate(int i, Data& parameters) {
+        if (status[i] == 1) {
+            return 0.0;
+        }
+        return infectionRateOf(i, parameters);
+    }
+
+    // The rate node i would be infected at, were it susceptible.
+    template <int Kind, int Infection>
+    double infectionRateOf(int i, Data& parameters) const {
+        double lambda = parameters.C / size();
+
+        if (Kind == KIND_CLIQUE) {
+            int k = infectedTotal - status[i];
+            return (Infection == 1) ? lambda * gammaPower(k) : lambda + parameters.gamma * k;
+        }
+        if (Infection == 1) {
+            return lambda * gammaPower(infectedNeighbors[i]) * infectedWeight[i];
+        }
+        return lambda + parameters.gamma * infectedWeight[i];
+    }
+
+    double infectionRateOf(int i, Data& parameters) const {
+        if (topology->kind() == KIND_CLIQUE) {
+            return (parameters.infectionType == 1) ? infectionRateOf<KIND_CLIQUE, 1>(i, parameters) : infectionRateOf<KIND_CLIQUE, 2>(i, parameters);
+        }
+        return (parameters.infectionType == 1) ? infectionRateOf<KIND_CSR, 1>(i, parameters) : infectionRateOf<KIND_CSR, 2>(i, parameters);
+    }
+
+    // Flips the status of a node and, under the incremental engine, updates
+    // only the rates of the nodes adjacent to it.
+    template <int Kind, int Infection>
+    void setStatusOf(int i, int newStatus, Data& parameters) {
+        status[i] = newStatus;
+        if (newStatus == 1) {
+            infectedBits[i / 64] |= (uint64_t) 1 << (i % 64);
+            infectedTotal++;
+        }
+        else {
+            infectedBits[i / 64] &= ~((uint64_t) 1 << (i % 64));
+            infectedTotal--;
+        }
+        if (!incremental) {
+            return;
+        }
+
+        if (Kind == KIND_CLIQUE) {
+            if (newStatus == 1) {
+                int last = susceptible.back();
+                susceptible[slot[i]] = last;
+                slot[last] = slot[i];
+                susceptible.pop_back();
+            }
+            else {
+                slot[i] = susceptible.size();
+                susceptible.push_back(i);
+            }
+            return;
+        }
+
+        infectionRate.update(i, newStatus == 1 ? 0.0 : infectionRateOf<Kind, Infection>(i, parameters));
+        topology->forEachDependentOf<Kind>(i, [&](int j, int weight) {
+            if (newStatus == 1) {
+                infectedNeighbors[j]++;
+                if (Infection == 1) {
+                    infectedWeight[j] *= weight;
+                }
+                else {
+                    infectedWeight[j] += weight;
+                }
+            }
+            else {
+                infectedNeighbors[j]--;
+                if (Infection == 1) {
+                    infectedWeight[j] /= weight;
+                }
+                else {
+                    infectedWeight[j] -= weight;
+                }
+            }
+
+            if (status[j] == 0) {
+                infectionRate.update(j, infectionRateOf<Kind, Infection>(j, parameters));
+            }
+        });
+    }
+
+    template <int Kind>
+    void setStatusOn(int i, int newStatus, Data& parameters) {
+        if (parameters.infectionType == 1) {
+            setStatusOf<Kind, 1>(i, newStatus, parameters);
+        }
+        else {
+            setStatusOf<Kind, 2>(i, newStatus, parameters);
+        }
+    }
+
+    // setStatus for callers outside the kernels, which pick the kernel for
+    // every call.
+    void setStatus(int i, int newStatus, Data& parameters) {
+        switch (topology->kind()) {
+            case KIND_CLIQUE:
+                setStatusOn<KIND_CLIQUE>(i, newStatus, parameters);
+                break;
+            case KIND_STAR:
+                setStatusOn<KIND_STAR>(i, newStatus, parameters);
+                break;
+            case KIND_CIRCULAR:
+                setStatusOn<KIND_CIRCULAR>(i, newStatus, parameters);
+                break;
+            default:
+                setStatusOn<KIND_CSR>(i, newStatus, parameters);
+        }
+    }
+
+    // Gillespie step: a single draw for the time to the next infection over
+    // the total rate, then the infected node is picked from the sum tree, or
+    // uniformly among the susceptible nodes on the Clique.
+    template <int Kind, int Infection>
+    Event sampleNextInfectionOf(Data& parameters, RandomStream& rng) {
+        double totalRate;
+
+        if (Kind == KIND_CLIQUE) {
+            totalRate = susceptible.empty() ? 0.0 : susceptible.size() * infectionRateOf<Kind, Infection>(susceptible[0], parameters);
+        }
+        else {
+            totalRate = infectionRate.total();
+        }
+
+        if (totalRate <= 0) {
+            return Event(-1, 0);
+        }
+
+        double infTime = rng.exponential(totalRate);
+
+        if (Kind == KIND_CLIQUE) {
+            int count = susceptible.size();
+            return Event(susceptible[min((int) (rng.uniform() * count), count - 1)], infTime);
+        }
+        return Event(infectionRate.find((1.0 - rng.uniform()) * totalRate), infTime);
+    }
+};
+
+void writeMainParameter(Data parameters, ostream& out) {
+    out << parameters.printMainParameter() << " ";
+    if (parameters.mainParameter == 1) {
+        out << parameters.gamma;
+    }
+    else if (parameters.mainParameter == 2) {
+        out << parameters.mu;
+    }
+    else if (parameters.mainParameter == 3) {
+        out << parameters.C;
+    }
+    out << endl;
+}
+
+// Infection rate of a susceptible node with k infected neighbors, all of
+// unit weight, exactly as the simulation engines compute it.
+double infectionRateFor(int k, double lambda, Data& parameters) {
+    if (parameters.infectionType == 1) {
+        return lambda * pow(parameters.gamma, k);
+    }
+    return lambda + parameters.gamma * k;
+}
+
+// On a clique the state collapses to the number k of infected nodes, a
+// birth-death chain with births (n-k) * rate(k) and deaths k * mu. Its
+// stationary distribution follows from detailed balance, kept in logs so
+// that large populations neither overflow nor underflow.
+double exactCliqueInfected(int n, Data& parameters) {
+    double lambda = parameters.C / n;
+    vector<double> logPi(n + 1, -INFINITY);
+    double maxLogPi = 0.0;
+    double total = 0.0, expected = 0.0;
+
+    logPi[0] = 0.0;
+    for (int k = 0; k < n; k++) {
+        double logBirth;
+
+        // gamma^k overflows long before k reaches large populations.
+        if (parameters.infectionType == 1) {
+            if (lambda <= 0 || parameters.gamma <= 0) {
+                break;
+            }
+            logBirth = log(n - k) + log(lambda) + k * log(parameters.gamma);
+        }
+        else {
+            double birth = (n - k) * infectionRateFor(k, lambda, parameters);
+
+            if (birth <= 0) {
+                break;
+            }
+            logBirth = log(birth);
+        }
+        logPi[k + 1] = logPi[k] + logBirth - log((k + 1) * parameters.mu);
+        maxLogPi = max(maxLogPi, logPi[k + 1]);
+    }
+
+    for (int k = 0; k <= n; k++) {
+        double pi = exp(logPi[k] - maxLogPi);
+
+        total += pi;
+        expected += pi * k;
+    }
+
+    return expected / total;
+}
+
+// On a star the state collapses to the hub status h and the number m of
+// infected leaves. Ordering states by m gives a level-dependent
+// quasi-birth-death chain with two phases per level, solved by block
+// elimination from the top level down: pi[m] = pi[m-1] * R[m-1], where
+// R[m-1] = Up(m-1) * (-S[m])^-1 and S[m] = Local(m) + R[m] * Down(m+1).
+double exactStarInfected(int n, Data& parameters) {
+    typedef array<double, 4> Block;
+    int leaves = n - 1;
+    double lambda = parameters.C / n;
+    double mu = parameters.mu;
+    vector<Block> R(max(leaves, 1));
+    Block S;
+
+    auto up = [&](int m, int h) {
+        return (leaves - m) * infectionRateFor(h, lambda, parameters);
+    };
+    auto local = [&](int m) {
+        // Past this rate the hub is infected with probability 1 to double
+        // precision, and capping it keeps gamma^m from overflowing.
+        double hubInfection = min(infectionRateFor(m, lambda, parameters), 1e100);
+        Block L = {{-(hubInfection + up(m, 0) + m * mu), hubInfection,
+                    mu, -(mu + up(m, 1) + m * mu)}};
+        return L;
+    };
+
+    S = local(leaves);
+    for (int m = leaves; m >= 1; m--) {
+        double det = S[0] * S[3] - S[1] * S[2];
+        // (-S)^-1 = -adj(S) / det(S)
+        Block inverse = {{-S[3] / det, S[1] / det, S[2] / det, -S[0] / det}};
+        Block& r = R[m - 1];
+
+        r[0] = up(m - 1, 0) * inverse[0];
+        r[1] = up(m - 1, 0) * inverse[1];
+        r[2] = up(m - 1, 1) * inverse[2];
+        r[3] = up(m - 1, 1) * inverse[3];
+
+        S = local(m - 1);
+        for (int i = 0; i < 4; i++) {
+            S[i] += r[i] * m * mu;
+        }
+    }
+
+    // pi[0] * S[0] = 0 for a singular 2x2 S.
+    double pi0 = S[2], pi1 = -S[0];
+    double total = 0.0, expected = 0.0;
+
+    for (int m = 0; m <= leaves; m++) {
+        if (m > 0) {
+            Block& r = R[m - 1];
+            double next0 = pi0 * r[0] + pi1 * r[2];
+            double next1 = pi0 * r[1] + pi1 * r[3];
+
+            pi0 = next0;
+            pi1 = next1;
+        }
+
+        total += pi0 + pi1;
+        expected += pi0 * m + pi1 * (m + 1);
+
+        // Probabilities are only normalised at the end, so rescale
+        // everything together whenever the running values get large.
+        if (total > 1e200) {
+            pi0 *= 1e-200;
+            pi1 *= 1e-200;
+            total *= 1e-200;
+            expected *= 1e-200;
+        }
+    }
+
+    return expected / total;
+}
+
+// The Multiplicative chain on an undirected, unweighted graph is
+// reversible, with the product-form stationary distribution
+// pi(x) ~ (lambda / mu)^|x| * gamma^e(x), where e(x) is the number of edges
+// with both ends infected, as in scaled_SIS_model.py. Configurations are
+// bitmasks, visited in Gray code order so each one differs from the last
+// in one node and e(x) moves by a popcount against that node's adjacency
+// row. The weight only depends on |x| and e(x), so each thread just counts
+// the configurations for every pair of them, exactly, and the weights are
+// applied once at the end. Returns false for the graphs this does not cover.
+bool exactBitmaskInfected(const Topology& topology, Data& parameters, double& expected) {
+    int n = topology.size();
+    vector<uint64_t> adjacency(n, 0);
+    bool unit = true;
+
+    if (parameters.infectionType != 1 || n > EXACT_MAX_NODES || !topology.inOffset.empty()) {
+        return false;
+    }
+    for (int i = 0; i < n; i++) {
+        topology.forEachNeighbor(i, [&](int j, int weight) {
+            unit = unit && weight == 1;
+            if (j != i) {
+                adjacency[i] |= (uint64_t) 1 << j;
+            }
+        });
+    }
+    if (!unit) {
+        return false;
+    }
+
+    int edgeCounts = n * (n - 1) / 2 + 1;
+    uint64_t configurations = (uint64_t) 1 << n;
+    int nThreads = max(1, min(parameters.threads, (int) min(configurations, (uint64_t) 1024)));
+    vector<vector<uint64_t> > count(nThreads, vector<uint64_t>((n + 1) * edgeCounts, 0));
+    vector<thread> workers;
+
+    auto work = [&](int worker) {
+        uint64_t first = configurations / nThreads * worker;
+        uint64_t last = (worker == nThreads - 1) ? configurations : configurations / nThreads * (worker + 1);
+        uint64_t* configurationsWith = count[worker].data();
+        uint64_t x = first ^ (first >> 1);
+        int infected = __builtin_popcountll(x);
+        int edges = 0;
+
+        for (int i = 0; i < n; i++) {
+            if (x >> i & 1) {
+                edges += __builtin_popcountll(adjacency[i] & x);
+            }
+        }
+        edges /= 2;
+        configurationsWith[infected * edgeCounts + edges]++;
+
+        for (uint64_t g = first + 1; g < last; g++) {
+            int node = __builtin_ctzll(g);
+            uint64_t bit = (uint64_t) 1 << node;
+
+            x ^= bit;
+            if (x & bit) {
+                infected++;
+                edges += __builtin_popcountll(adjacency[node] & x);
+            }
+            else {
+                infected--;
+                edges -= __builtin_popcountll(adjacency[node] & x);
+            }
+            configurationsWith[infected * edgeCounts + edges]++;
+        }
+    };
+
+    if (nThreads == 1) {
+        work(0);
+    }
+    else {
+        for (int t = 0; t < nThreads; t++) {
+            workers.push_back(thread(work, t));
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    // Weights in long double, whose range covers gamma^(N(N-1)/2).
+    long double ratio = (long double) parameters.C / n / parameters.mu;
+    long double total = 0.0L, infectedSum = 0.0L;
+    for (int k = 0; k <= n; k++) {
+        for (int e = 0; e < edgeCounts; e++) {
+            uint64_t configurationsWith = 0;
+
+            for (int t = 0; t < nThreads; t++) {
+                configurationsWith += count[t][k * edgeCounts + e];
+            }
+            if (configurationsWith > 0) {
+                long double weight = configurationsWith * powl(ratio, k) * powl(parameters.gamma, e);
+
+                total += weight;
+                infectedSum += weight * k;
+            }
+        }
+    }
+    expected = infectedSum / total;
+
+    return true;
+}
+
+// Exact expected number of infected nodes. The Clique and the Star collapse
+// to O(N) states; other graphs with up to EXACT_MAX_NODES nodes are summed
+// over every configuration. Returns false for the rest.
+bool exactExpectedInfected(int n, Data& parameters, double& expected, const Topology* topology = NULL) {
+    if (parameters.type == 1) {
+        expected = exactCliqueInfected(n, parameters);
+        return true;
+    }
+    else if (parameters.type == 2) {
+        expected = exactStarInfected(n, parameters);
+        return true;
+    }
+    if (n > EXACT_MAX_NODES || parameters.infectionType != 1) {
+        return false;
+    }
+    if (topology != NULL) {
+        return exactBitmaskInfected(*topology, parameters, expected);
+    }
+
+    Topology graph(n, parameters);
+    return graph.error.empty() && exactBitmaskInfected(graph, parameters, expected);
+}
+
+// Writes the same model_ and validation_ files as scaled_SIS_model.py.
+// Returns false if some population has no exact solution.
+bool writeExactReference(Data& parameters) {
+    double expected = 0.0;
+    vector<int> populations;
+
+    if (parameters.type == 4) {
+        populations.push_back(parameters.pop);
+    }
+    else {
+        for (int pop = parameters.minPop; pop <= parameters.maxPop; pop += parameters.increment) {
+            populations.push_back(pop);
+        }
+    }
+
+    ofstream modelFile("model_" + parameters.outputFileName);
+    ofstream validationFile("validation_" + parameters.outputFileName);
+
+    writeMainParameter(parameters, modelFile);
+    writeMainParameter(parameters, validationFile);
+    for (auto pop : populations) {
+        if (!exactExpectedInfected(pop, parameters, expected)) {
+            return false;
+        }
+        modelFile << pop << " " << fixed << setprecision(5) << expected/pop << endl;
+        validationFile << pop << " " << fixed << setprecision(5) << expected << endl;
+    }
+
+    return true;
+}
+
+Data runUI(Data oldParam) {
+    char option = 'x';
+    Data newParam;
+
+    if (oldParam.set == true) {
+        newParam = oldParam;
+    }
+    newParam.set = true;
+    newParam.run = false;
+
+    while (option != 'R' && option != 'r') {
+        cout << "--------------------------------------" << endl;
+        cout << "|        Welcome to PlagueSim        |" << endl;
+        cout << "--------------------------------------" << endl;
+        cout << endl << "RATES:" << endl;
+        cout << "[E]ndogenous Infection Rate = " << newParam.gamma << endl;
+        cout << "[T]otal Exogenous Infection Rate = " << newParam.C << endl;
+        cout << "[H]ealing Rate = " << newParam.mu << endl;
+        cout << endl << "GRAPH SETTINGS:" << endl;
+        if (newParam.type != 4) {
+            cout << "[S]tarting Population = " << newParam.minPop << endl;
+            cout << "[M]aximum Population = " << newParam.maxPop << endl;
+            cout << "[J]ump = " << newParam.increment << endl;
+        }
+        if (newParam.type >= 5) {
+            cout << "Graph Generator Settings (set with [G]raph Type) = degree " << newParam.graphDegree;
+            cout << (newParam.type == 7 ? ", rewiring " + to_string(newParam.rewiring) : "") << ", seed " << newParam.graphSeed << endl;
+        }
+        else if (newParam.type == 4) {
+            cout << "[A]djacency File = " << newParam.inputFileName << endl;
+            cout << "Popu[L]ation = " << newParam.pop << endl;
+        }
+        cout << endl << "SIMULATOR SETTINGS:" << endl;
+        cout << "[G]raph Type = " << newParam.printGraphType() << endl;
+        cout << "[I]nfection Type = " << newParam.printInfectionType() << endl;
+        cout << "E[N]gine = " << newParam.printEngine() << endl;
+        cout << "[W]orker Threads = " << newParam.threads << endl;
+        cout << "Stead[Y]-State Estimator = " << newParam.printEstimator() << endl;
+        if (newParam.estimator == 1) {
+            cout << "Variance Reduction (set with Stead[Y]-State Estimator) = " << newParam.printVarianceReduction() << endl;
+        }
+        cout << "[U]se Exact Solution = " << (newParam.exact ? "Yes" : "No") << endl;
+        cout << "Generator [K]ind = " << newParam.printGenerator() << endl;
+        cout << "Ran[D]om Seed = " << newParam.seed << (newParam.seed == 0 ? " (clock)" : "") << endl;
+        cout << "[C]onfidence Interval = " << newParam.confidence << endl;
+        cout << "[O]utput File = " << newParam.outputFileName << endl;
+        if (newParam.hack) {
+            cout << "Trajectory [F]ormat = " << newParam.printTrajectory() << endl;
+        }
+        cout << "[P]rint Parameter = " << newParam.printMainParameter() << endl;
+        cout << "Performance Analy[Z]er = " << (newParam.profile ? "On" : "Off") << endl;
+        cout << "Checkpoints [Q] = " << (newParam.checkpoint ? "On" : "Off") << endl;
+        cout << "Result Cache (set with Checkpoints [Q]) = " << (newParam.resultCache ? "On" : "Off") << endl;
+        cout << endl << "ACTIONS:" << endl;
+        cout << "[R]un the Simulation" << endl;
+        cout << "Write Exact [V]alidation Reference" << endl;
+        if (newParam.type == 4) {
+            cout << "Save Custom Graph as [B]inary CSR" << endl;
+        }
+        cout << "E[X]it PlagueSim." << endl << endl;
+
+        cout << "Select an option: ";
+        cin >> option;
+
+        switch (option) {
+            case '@':
+                cout << "YOU ARE HACK!" << endl;
+                newParam.hack = true;
+                break;
+            case 'E':
+            case 'e':
+                cout << "This is the rate that nodes infect each other." << endl;
+                cout << "Please set a new value for Endogenous Infection: ";
+                cin >> newParam.gamma;
+                break;
+            case 'T':
+            case 't':
+                cout << "This is the total rate that nodes get infected." << endl;
+                cout << "Node infection rate will be this value divided by the population." << endl;
+                cout << "Please set a new value for the Exogenous Infection: ";
+                cin >> newParam.C;
+                break;
+            case 'H':
+            case 'h':
+                cout << "This is the rate that nodes heal themselves from infection." << endl;
+                cout << "Please set a new value for the Healing Rate: ";
+                cin >> newParam.mu;
+                break;
+            case 'S':
+            case 's':
+                cout << "Starting Population is the smallest population size that will be simulated." << endl;
+                cout << "Please set a new value for the Starting Population: ";
+                cin >> newParam.minPop;
+                break;
+            case 'M':
+            case 'm':
+                cout << "Maximum Population is the largest population size that will be simulated." << endl;
+                cout << "Please set a new value for the Maximum Population: ";
+                cin >> newParam.maxPop;
+                break;
+            case 'J':
+            case 'j':
+                cout << "Increment will increase the population size until Maximum Population." << endl;
+                cout << "Smaller values of increment means a smoother graph, but take longer to simulate." << endl;
+                cout << "Please set a new Increment value: ";
+                cin >> newParam.increment;
+                break;
+            case 'A':
+            case 'a':
+                cout << "Files ending in .edges are read as sparse edge lists, with one \"src dst [weight]\" per line." << endl;
+                cout << "Files ending in .csr are mapped as binary CSR graphs. Anything else is read as an adjacency matrix." << endl;
+                cout << "Please select the file containing your graph: ";
+                cin >> newParam.inputFileName;
+                break;
+            case 'L':
+            case 'l':
+                cout << "Note your adjacency matrix must fit the selected size." << endl;
+                cout << "Please select your population size: ";
+                cin >> newParam.pop;
+                break;
+            case 'G':
+            case 'g':
+                cout << "[1]. Clique" << endl;
+                cout << "[2]. Star" << endl;
+                cout << "[3]. Circular" << endl; 
+                cout << "[4]. Custom (requires adjacency matrix file)" << endl;
+                cout << "[5]. Erdos-Renyi (random)" << endl;
+                cout << "[6]. Barabasi-Albert (preferential attachment)" << endl;
+                cout << "[7]. Watts-Strogatz (small world)" << endl;
+                cout << "[8]. Lattice (2-D, periodic)" << endl;
+                cout << "Please select a preset graph type for the simulation: ";
+                cin >> newParam.type;
+                if (newParam.type < 1 || newParam.type > 8) {
+                    cout << "Invalid Graph type. Setting to default type: Clique." << endl;
+                    newParam.type = 1;
+                }
+                if (newParam.type == 5 || newParam.type == 6 || newParam.type == 7) {
+                    cout << "Erdos-Renyi graphs get this mean degree, Barabasi-Albert nodes attach with half as many edges" << endl;
+                    cout << "and Watts-Strogatz nodes start linked to this many ring neighbors." << endl;
+                    cout << "Please set the mean degree: ";
+                    cin >> newParam.graphDegree;
+                    if (newParam.graphDegree < 1) {
+                        cout << "Invalid degree. Setting to default: 4." << endl;
+                        newParam.graphDegree = 4;
+                    }
+                }
+                if (newParam.type == 7) {
+                    cout << "Please set the probability that each ring edge is rewired: ";
+                    cin >> newParam.rewiring;
+                }
+                if (newParam.type >= 5) {
+                    cout << "Please set the seed of the graph generator: ";
+                    cin >> newParam.graphSeed;
+                }
+                break;
+            case 'I':
+            case 'i':
+                cout << "[1]. Multiplicative" << endl;
+                cout << "[2]. Additive" << endl;
+                cout << "Please select how endogenous infection will be modeled: ";
+                cin >> newParam.infectionType;
+                if (newParam.infectionType < 1 || newParam.infectionType > 2) {
+                    cout << "Invalid Infection type. Setting to default: Multiplicative." << endl;
+                    newParam.infectionType = 1;
+                }
+                break;
+            case 'N':
+            case 'n':
+                cout << "[1]. Full Scan" << endl;
+                cout << "[2]. Incremental" << endl;
+                cout << "[4]. Tau Leaping (approximate)" << endl;
+                cout << "Full Scan redraws every node at each event, Incremental only updates the neighbors of the node that changed." << endl;
+                cout << "Tau Leaping advances many events at once, for populations too large for the exact engines." << endl;
+                cout << "Please select the simulation engine: ";
+                cin >> newParam.engine;
+                if (newParam.engine < 1 || newParam.engine > 4 || newParam.engine == 3) {
+                    cout << "Invalid engine. Setting to default: Incremental." << endl;
+                    newParam.engine = 2;
+                }
+                if (newParam.engine == 4) {
+                    cout << "Each leap keeps the expected change in the number of infected, and its deviation," << endl;
+                    cout << "within this fraction of it. Smaller is slower and closer to the exact engines." << endl;
+                    cout << "Please enter the tau leaping tolerance [0.03]: ";
+                    cin >> newParam.tauTolerance;
+                    if (newParam.tauTolerance <= 0 || newParam.tauTolerance >= 1) {
+                        cout << "Invalid tolerance. Setting to default: 0.03." << endl;
+                        newParam.tauTolerance = 0.03;
+                    }
+                }
+                break;
+            case 'W':
+            case 'w':
+                cout << "Replications are split across this many threads." << endl;
+                cout << "Please set the number of worker threads: ";
+                cin >> newParam.threads;
+                if (newParam.threads < 1) {
+                    cout << "Invalid number of threads. Setting to default: 1." << endl;
+                    newParam.threads = 1;
+                }
+                break;
+            case 'K':
+            case 'k':
+                cout << "[1]. Mersenne Twister (mt19937_64)" << endl;
+                cout << "[2]. xoshiro256++" << endl;
+                cout << "Please select the random number generator: ";
+                cin >> newParam.generator;
+                if (newParam.generator < 1 || newParam.generator > 2) {
+                    cout << "Invalid generator. Setting to default: xoshiro256++." << endl;
+                    newParam.generator = 2;
+                }
+                break;
+            case 'D':
+            case 'd':
+                cout << "Runs with the same nonzero seed give the same results, whatever the number of threads." << endl;
+                cout << "Please set the random seed (0 seeds from the clock): ";
+                cin >> newParam.seed;
+                break;
+            case 'C':
+            case 'c':
+                cout << "Lower values have better accuracy, but take longer to simulate." << endl;
+                cout << "Please set a new Confidence Interval: ";
+                cin >> newParam.confidence;
+                break;
+            case 'O':
+            case 'o':
+                cout << "Please set where to save output for graph making: ";
+                cin >> newParam.outputFileName;
+                break;
+            case 'P':
+            case 'p':
+                cout << "[1]. Endogenous Infection Rate" << endl;
+                cout << "[2]. Healing Rate" << endl;
+                cout << "[3]. Total Exogenous Infection Rate" << endl;
+                cout << "Please choose which parameter you are interested in: ";
+                cin >> newParam.mainParameter;
+                if (newParam.mainParameter < 1 || newParam.mainParameter > 3) {
+                    cout << "Invalid parameter. Setting to default: Endogenous Infection Rate" << endl;
+                    newParam.mainParameter = 1;
+                }
+                break;
+            case 'F':
+            case 'f':
+                cout << "[1]. Text" << endl;
+                cout << "[2]. Binary (memory-mappable records)" << endl;
+                cout << "Please select the trajectory format: ";
+                cin >> newParam.trajectoryFormat;
+                if (newParam.trajectoryFormat < 1 || newParam.trajectoryFormat > 2) {
+                    cout << "Invalid format. Setting to default: Text." << endl;
+                    newParam.trajectoryFormat = 1;
+                }
+                cout << "A positive interval resamples the trajectory on a fixed time grid." << endl;
+                cout << "Please set the sampling interval (0 records events): ";
+                cin >> newParam.trajectoryInterval;
+                if (newParam.trajectoryInterval <= 0) {
+                    newParam.trajectoryInterval = 0.0;
+                    cout << "Please set how many events make one record: ";
+                    cin >> newParam.trajectoryDecimation;
+                    if (newParam.trajectoryDecimation < 1) {
+                        newParam.trajectoryDecimation = 1;
+                    }
+                }
+                break;
+            case 'Y':
+            case 'y':
+                cout << "[1]. Final Snapshot (the infected count at the end of independent replications)" << endl;
+                cout << "[2]. Time Average (batch means over one long run, after a warm-up period)" << endl;
+                cout << "Please select how the steady state will be estimated: ";
+                cin >> newParam.estimator;
+                if (newParam.estimator < 1 || newParam.estimator > 2) {
+                    cout << "Invalid estimator. Setting to default: Final Snapshot." << endl;
+                    newParam.estimator = 1;
+                }
+                if (newParam.estimator == 1) {
+                    cout << "[1]. None" << endl;
+                    cout << "[2]. Common Random Numbers (every population size and every sweep with the same seed share their streams)" << endl;
+                    cout << "[3]. Control Variate (a zero-mean correction from the last moments of each replication)" << endl;
+                    cout << "[4]. Both" << endl;
+                    cout << "The control variate applies to the Full Scan and Incremental engines." << endl;
+                    cout << "Please select the variance reduction: ";
+                    cin >> newParam.varianceReduction;
+                    if (newParam.varianceReduction < 1 || newParam.varianceReduction > 4) {
+                        cout << "Invalid variance reduction. Setting to default: None." << endl;
+                        newParam.varianceReduction = 1;
+                    }
+                }
+                break;
+            case 'U':
+            case 'u':
+                cout << "Clique and Star graphs have an exact solution, which replaces the simulation when enabled." << endl;
+                cout << "So do Multiplicative infection on other undirected, unweighted graphs of up to " << EXACT_MAX_NODES << " nodes," << endl;
+                cout << "which takes twice as long with each extra node." << endl;
+                cout << "Other graph types are always simulated." << endl;
+                cout << "Please choose whether to use the exact solution [1 = Yes, 0 = No]: ";
+                cin >> newParam.exact;
+                break;
+            case 'V':
+            case 'v':
+                if (writeExactReference(newParam)) {
+                    cout << "Exact results saved at model_" << newParam.outputFileName;
+                    cout << " and validation_" << newParam.outputFileName << "." << endl;
+                }
+                else {
+                    cout << "Exact results are only available for Clique and Star graphs, and for Multiplicative" << endl;
+                    cout << "infection on undirected, unweighted graphs of up to " << EXACT_MAX_NODES << " nodes." << endl;
+                }
+                break;
+            case 'B':
+            case 'b':
+                {
+                    string csrFileName;
+                    Topology topology(newParam.pop, newParam);
+
+                    if (newParam.type != 4) {
+                        cout << "Only Custom graphs are read from files." << endl;
+                        break;
+                    }
+                    if (!topology.error.empty()) {
+                        cout << "Could not load the graph: " << topology.error << "." << endl;
+                        break;
+                    }
+                    cout << "Please set where to save the binary CSR graph: ";
+                    cin >> csrFileName;
+                    if (topology.saveBinary(csrFileName)) {
+                        cout << "Graph saved at " << csrFileName << "." << endl;
+                    }
+                    else {
+                        cout << "Could not write " << csrFileName << "." << endl;
+                    }
+                }
+                break;
+            case 'Z':
+            case 'z':
+                cout << "When on, event counts, time per phase, replications and peak memory" << endl;
+                cout << "are reported for each population and saved at profile_" << newParam.outputFileName << "." << endl;
+                cout << "Please choose whether to profile the simulation [1 = On, 0 = Off]: ";
+                cin >> newParam.profile;
+                break;
+            case 'Q':
+            case 'q':
+                cout << "When on, progress is saved at " << newParam.outputFileName << ".checkpoint every " << CHECKPOINT_SECONDS << " seconds" << endl;
+                cout << "and after each population. A run with the same settings resumes from it, with the same results." << endl;
+                cout << "Please choose whether to save checkpoints [1 = On, 0 = Off]: ";
+                cin >> newParam.checkpoint;
+                cout << "When on, finished population sizes are kept in " << CACHE_DIRECTORY << " and later runs with the same" << endl;
+                cout << "settings take them from there. A tighter confidence only runs the extra replications." << endl;
+                cout << "Please choose whether to use the result cache [1 = On, 0 = Off]: ";
+                cin >> newParam.resultCache;
+                break;
+            case 'R':
+            case 'r':
+                cout << "The simulation will start now." << endl;
+                newParam.run = true;
+                break;
+            case 'X':
+            case 'x':
+                cout << "Closing application..." << endl;
+                option = 'R';
+                break;
+            default:
+                cout << "Invalid command." << endl;
+        }
+        cout << endl;
+    }
+
+    return newParam;
+}
+
+// Min-heap order for pending cures: the earliest timestamp is on top.
+struct EventLater {
+    bool operator()(const Event& a, const Event& b) const {
+        return (a.eventTime > b.eventTime);
+    }
+};
+
+typedef priority_queue<Event, vector<Event>, EventLater> CureQueue;
+
+// Two-sided 97.5% quantile of Student's t with dof degrees of freedom, from
+// the Cornish-Fisher expansion around the normal quantile. It is within
+// 1e-3 of the exact value from 10 degrees of freedom up, and the stopping
+// rule never looks at fewer than MIN_ITERATIONS samples.
+double studentT975(long long dof) {
+    double z = 1.959964;
+    double z3 = z*z*z, z5 = z3*z*z, z7 = z5*z*z;
+    double v = dof;
+
+    return z + (z3 + z) / (4*v) + (5*z5 + 16*z3 + 3*z) / (96*v*v) + (3*z7 + 19*z5 + 17*z3 - 15*z) / (384*v*v*v);
+}
+
+// Running mean and variance by Welford's method, O(1) per sample.
+struct SampleStats {
+    long long count;
+    double mean, m2;
+
+    SampleStats(): count(0), mean(0), m2(0) {};
+
+    void add(double value) {
+        double delta = value - mean;
+
+        count++;
+        mean += delta / count;
+        m2 += delta * (value - mean);
+    }
+
+    double variance() const {
+        return (count > 1) ? m2 / (count - 1) : 0.0;
+    }
+
+    // Same width convention the simulator has always used for its stopping
+    // rule and output: mean +- 2 * 1.96 * s / sqrt(n).
+    double confidenceInterval() const {
+        return (2 * 1.96 * sqrt(variance())) / (sqrt(count));
+    }
+
+    double tConfidenceInterval() const {
+        if (count < 2) {
+            return 0.0;
+        }
+        return (2 * studentT975(count - 1) * sqrt(variance())) / (sqrt(count));
+    }
+};
+
+// Replication statistics with control variates, further values of every
+// replication whose means are known to be zero. Each value is kept less its
+// controls times the regression coefficients fitted to the replications
+// before it, which leaves its mean as it was, so the plain mean and interval
+// of the adjusted values stay correct. The first CONTROL_PILOT replications
+// only feed the fit. Controls that stay constant, or that the others
+// explain, are left out of the fit. Without controls the values are kept
+// as they are.
+//
+// Entry 0 of mean and comoment is the value, entries 1 on are the controls.
+struct ControlledStats {
+    SampleStats adjusted;
+    long long count;
+    double mean[CONTROL_VARIATES + 1];
+    double comoment[CONTROL_VARIATES + 1][CONTROL_VARIATES + 1];
+
+    ControlledStats(): count(0) {
+        fill(mean, mean + CONTROL_VARIATES + 1, 0.0);
+        fill(&comoment[0][0], &comoment[0][0] + (CONTROL_VARIATES + 1) * (CONTROL_VARIATES + 1), 0.0);
+    };
+
+    void add(double value, const double* controls) {
+        double x[CONTROL_VARIATES + 1], delta[CONTROL_VARIATES + 1];
+
+        if (controls == NULL) {
+            adjusted.add(value);
+            count++;
+            return;
+        }
+        if (count >= CONTROL_PILOT) {
+            adjusted.add(value - prediction(controls));
+        }
+
+        x[0] = value;
+        copy(controls, controls + CONTROL_VARIATES, x + 1);
+        count++;
+        for (int i = 0; i <= CONTROL_VARIATES; i++) {
+            delta[i] = x[i] - mean[i];
+            mean[i] += delta[i] / count;
+        }
+        for (int i = 0; i <= CONTROL_VARIATES; i++) {
+            for (int j = 0; j <= CONTROL_VARIATES; j++) {
+                comoment[i][j] += delta[i] * (x[j] - mean[j]);
+            }
+        }
+    }
+
+    // The controls times their coefficients so far. The controls are swept
+    // out of a copy of the comoment matrix one by one, after which a[j][0]
+    // is the coefficient of control j.
+    double prediction(const double* controls) const {
+        double a[CONTROL_VARIATES + 1][CONTROL_VARIATES + 1];
+        bool used[CONTROL_VARIATES + 1];
+        double result = 0.0;
+
+        copy(&comoment[0][0], &comoment[0][0] + (CONTROL_VARIATES + 1) * (CONTROL_VARIATES + 1), &a[0][0]);
+        for (int k = 1; k <= CONTROL_VARIATES; k++) {
+            double pivot = a[k][k];
+
+            used[k] = pivot > 1e-9 * comoment[k][k];
+            if (!used[k]) {
+                continue;
+            }
+            for (int j = 0; j <= CONTROL_VARIATES; j++) {
+                a[k][j] /= pivot;
+            }
+            for (int i = 0; i <= CONTROL_VARIATES; i++) {
+                double factor = a[i][k];
+
+                if (i == k) {
+                    continue;
+                }
+                for (int j = 0; j <= CONTROL_VARIATES; j++) {
+                    a[i][j] -= factor * a[k][j];
+                }
+                a[i][k] = -factor / pivot;
+            }
+            a[k][k] = 1.0 / pivot;
+        }
+
+        for (int k = 1; k <= CONTROL_VARIATES; k++) {
+            if (used[k]) {
+                result += a[k][0] * controls[k - 1];
+            }
+        }
+        return result;
+    }
+
+    // One line of a checkpoint or cache entry: count, adjusted count, mean
+    // and m2, then the means and comoments.
+    void write(ostream& out) const {
+        out << count << " " << adjusted.count << " " << adjusted.mean << " " << adjusted.m2;
+        for (auto value : mean) {
+            out << " " << value;
+        }
+        for (auto& row : comoment) {
+            for (auto value : row) {
+                out << " " << value;
+            }
+        }
+    }
+
+    void read(istream& in) {
+        in >> count >> adjusted.count >> adjusted.mean >> adjusted.m2;
+        for (auto& value : mean) {
+            in >> value;
+        }
+        for (auto& row : comoment) {
+            for (auto& value : row) {
+                in >> value;
+            }
+        }
+    }
+};
+
+// Records the infected count over time for the time series ('@') mode.
+// Output goes through a large buffer instead of a flush per event, and can
+// be thinned to every k-th event or resampled on a fixed time grid.
+//
+// The text format keeps the original layout: "Population N", then one
+// "time infected" line per record and a blank line. The binary format is
+// meant to be memory-mapped: the 8-byte magic TRAJECTORY_MAGIC, then for
+// each population a uint32 population, a uint32 zero and a uint64 record
+// count, followed by that many {double time, int32 infected, int32 zero}.
+struct TrajectoryRecorder {
+    ostream& out;
+    bool binary;
+    double interval, nextSample;
+    int decimation, lastInfected;
+    long long events, records;
+    streampos countPosition;
+    vector<char> buffer;
+
+    TrajectoryRecorder(ostream& o, Data& parameters): out(o), binary(parameters.trajectoryFormat == 2),
+            interval(parameters.trajectoryInterval), nextSample(0), decimation(max(1, parameters.trajectoryDecimation)),
+            lastInfected(0), events(0), records(0) {
+        buffer.reserve(TRAJECTORY_BUFFER);
+        if (binary) {
+            append(TRAJECTORY_MAGIC, 8);
+        }
+    }
+
+    ~TrajectoryRecorder() {
+        flush();
+    }
+
+    void flush() {
+        out.write(buffer.data(), buffer.size());
+        buffer.clear();
+    }
+
+    void append(const void* data, size_t size) {
+        if (buffer.size() + size > TRAJECTORY_BUFFER) {
+            flush();
+        }
+        buffer.insert(buffer.end(), (const char*) data, (const char*) data + size);
+    }
+
+    void emit(double time, int infected) {
+        records++;
+        if (binary) {
+            int record[2] = {infected, 0};
+            append(&time, sizeof(time));
+            append(record, sizeof(record));
+        }
+        else {
+            char line[64];
+            int length = snprintf(line, sizeof(line), "%g %d\n", time, infected);
+            append(line, length);
+        }
+    }
+
+    void beginPopulation(int pop) {
+        nextSample = 0;
+        lastInfected = 0;
+        events = 0;
+        records = 0;
+        if (binary) {
+            unsigned int header[2] = {(unsigned int) pop, 0};
+            unsigned long long count = 0;
+
+            flush();
+            append(header, sizeof(header));
+            countPosition = out.tellp() + (streamoff) sizeof(header);
+            append(&count, sizeof(count));
+        }
+        else {
+            char line[64];
+            int length = snprintf(line, sizeof(line), "Population %d\n", pop);
+            append(line, length);
+        }
+    }
+
+    // Called after every event with the new infected count.
+    void record(double time, int infected) {
+        if (interval > 0) {
+            while (nextSample <= time) {
+                emit(nextSample, lastInfected);
+                nextSample += interval;
+            }
+            lastInfected = infected;
+        }
+        else if (++events % decimation == 0) {
+            emit(time, infected);
+        }
+    }
+
+    void endPopulation(double endTime) {
+        if (interval > 0) {
+            while (nextSample <= endTime) {
+                emit(nextSample, lastInfected);
+                nextSample += interval;
+            }
+        }
+
+        if (binary) {
+            unsigned long long count = records;
+
+            flush();
+            out.seekp(countPosition);
+            out.write((const char*) &count, sizeof(count));
+            out.seekp(0, ios::end);
+        }
+        else {
+            append("\n", 1);
+        }
+    }
+};
+
+// Counters for the performance report. The phase timers are only read
+// when profiling is on, so other runs pay one branch per event.
+struct Profile {
+    long long infections, cures, replications;
+    double selectSeconds, updateSeconds, cureSeconds, outputSeconds, wallSeconds;
+
+    Profile(): infections(0), cures(0), replications(0), selectSeconds(0), updateSeconds(0),
+            cureSeconds(0), outputSeconds(0), wallSeconds(0) {};
+
+    static double now() {
+        return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void merge(const Profile& other) {
+        infections += other.infections;
+        cures += other.cures;
+        replications += other.replications;
+        selectSeconds += other.selectSeconds;
+        updateSeconds += other.updateSeconds;
+        cureSeconds += other.cureSeconds;
+        outputSeconds += other.outputSeconds;
+        wallSeconds += other.wallSeconds;
+    }
+};
+
+// One trajectory of the chain over a Graph, compiled once for each kind of
+// topology and each infection type so neither is tested again between
+// events. next() draws the next event without applying it, so callers can
+// stop at a horizon or integrate the infected count up to the event time
+// before calling apply().
+template <int Kind, int Infection>
+struct Simulation {
+    Graph& graph;
+    CureQueue cures;
+    double time;
+    int infected;
+    Event pending;
+    bool pendingInfection;
+    Profile* profile;
+
+    Simulation(Graph& g, Profile* p = NULL): graph(g), time(0.0), infected(0), pendingInfection(false), profile(p) {};
+
+    // Returns false when no event can ever happen again.
+    bool next(Data& parameters, RandomStream& rng) {
+        double start = (profile != NULL) ? Profile::now() : 0.0;
+        bool found = select(parameters, rng);
+
+        if (profile != NULL) {
+            profile->selectSeconds += Profile::now() - start;
+        }
+
+        return found;
+    }
+
+    bool select(Data& parameters, RandomStream& rng) {
+        Event nextInfection;
+
+        if (parameters.engine != 1) {
+            nextInfection = graph.sampleNextInfectionOf<Kind, Infection>(parameters, rng);
+        }
+        else {
+            nextInfection = graph.findNextInfectionOf<Kind, Infection>(parameters, rng);
+        }
+
+        if (nextInfection.node == -1 && cures.empty()) {
+            return false;
+        }
+
+        // Cures are stored with absolute timestamps, so an infection
+        // wins only if it happens strictly before the earliest cure.
+        pendingInfection = nextInfection.node != -1 &&
+                (cures.empty() || cures.top().eventTime > time + nextInfection.eventTime);
+        if (pendingInfection) {
+            pending = Event(nextInfection.node, time + nextInfection.eventTime);
+        }
+        else {
+            pending = cures.top();
+        }
+
+        return true;
+    }
+
+    void apply(Data& parameters, RandomStream& rng) {
+        if (profile != NULL) {
+            applyProfiled(parameters, rng);
+            return;
+        }
+
+        time = pending.eventTime;
+        if (pendingInfection) {
+            graph.setStatusOf<Kind, Infection>(pending.node, 1, parameters);
+            cures.push(Event(pending.node, time + rng.exponential(parameters.mu)));
+            infected++;
+
+            //cout << "(" << time << "t) Node " << pending.node << " has been infected." << endl;
+        }
+        else {
+            //cout << "(" << time << "t) Node " << pending.node << " has been healed." << endl;
+
+            graph.setStatusOf<Kind, Infection>(pending.node, 0, parameters);
+            cures.pop();
+            infected--;
+        }
+    }
+
+    // Same as apply, with the rate updates and the cure queue timed apart.
+    void applyProfiled(Data& parameters, RandomStream& rng) {
+        double start = Profile::now();
+        double updated;
+
+        time = pending.eventTime;
+        graph.setStatusOf<Kind, Infection>(pending.node, pendingInfection ? 1 : 0, parameters);
+        updated = Profile::now();
+        if (pendingInfection) {
+            cures.push(Event(pending.node, time + rng.exponential(parameters.mu)));
+            infected++;
+            profile->infections++;
+        }
+        else {
+            cures.pop();
+            infected--;
+            profile->cures++;
+        }
+
+        profile->updateSeconds += updated - start;
+        profile->cureSeconds += Profile::now() - updated;
+    }
+};
+
+// Mode is REPLICATION_PLAIN, REPLICATION_RECORD to pass every event to the
+// recorder, or REPLICATION_CONTROL to also return CONTROL_VARIATES control
+// variates. Control j weighs each change of the infected count by
+// exp(-a (maxTime - t)), a = mu / 2 * 2^j, and takes away the weighted
+// integral of the drift (infection rate minus cure rate), so it is a
+// martingale integral and its mean is zero. Where a matches how fast the
+// infected count forgets its past, the control nearly equals the final
+// count less its mean. Weights below exp(-CONTROL_HORIZON) are dropped,
+// which keeps the mean at zero and the cost to the last moments.
+template <int Kind, int Infection, int Mode>
+int runReplicationOf(Graph& graph, Data& parameters, RandomStream& rng, TrajectoryRecorder* recorder, Profile* profile, double* control) {
+    int pop = graph.size();
+    Simulation<Kind, Infection> simulation(graph, profile);
+
+    //for (int count = 0; count < MAX_ITERATIONS * pop; count++) {
+    //double maxTime = (1.0 * pop)/((parameters.C / pop) + parameters.gamma + parameters.mu);
+    double maxTime = MAX_TIME * pop;
+    double windowStart = max(maxTime - 2 * CONTROL_HORIZON / parameters.mu, 0.0);
+    double weight[CONTROL_VARIATES];
+
+    for (int j = 0; j < CONTROL_VARIATES; j++) {
+        weight[j] = exp(-parameters.mu / 2 * ldexp(1.0, j) * (maxTime - windowStart));
+        if (Mode == REPLICATION_CONTROL) {
+            control[j] = 0.0;
+        }
+    }
+
+    // The state holds from the current time until the given one, where the
+    // infected count changes by change.
+    auto integrate = [&](double until, int change) {
+        double drift, next;
+
+        if (until <= windowStart) {
+            return;
+        }
+        drift = graph.totalInfectionRateOf<Kind, Infection>(parameters) - parameters.mu * simulation.infected;
+        next = exp(-parameters.mu / 2 * (maxTime - until));
+        for (int j = 0; j < CONTROL_VARIATES; j++) {
+            control[j] += change * next - drift * (next - weight[j]) / (parameters.mu / 2 * ldexp(1.0, j));
+            weight[j] = next;
+            next *= next;
+        }
+    };
+
+    while (simulation.time < maxTime && simulation.next(parameters, rng)) {
+        if (simulation.pending.eventTime > maxTime) {
+            break;
+        }
+        if (Mode == REPLICATION_CONTROL) {
+            integrate(simulation.pending.eventTime, simulation.pendingInfection ? 1 : -1);
+        }
+        simulation.apply(parameters, rng);
+
+        if (Mode == REPLICATION_RECORD) {
+            recorder->record(simulation.time, simulation.infected);
+        }
+    }
+
+    if (profile != NULL) {
+        profile->replications++;
+    }
+
+    if (Mode == REPLICATION_RECORD) {
+        recorder->endPopulation(maxTime);
+    }
+    if (Mode == REPLICATION_CONTROL) {
+        integrate(maxTime, 0);
+    }
+
+    return simulation.infected;
+}
+
+typedef int (*ReplicationKernel)(Graph&, Data&, RandomStream&, TrajectoryRecorder*, Profile*, double*);
+
+// Picks the replication kernel for a sweep, once, before any event is run.
+ReplicationKernel replicationKernel(const Topology& topology, Data& parameters, int mode) {
+    static const ReplicationKernel kernels[KERNEL_KINDS][2][3] = {
+        {{runReplicationOf<KIND_CSR, 1, REPLICATION_PLAIN>, runReplicationOf<KIND_CSR, 1, REPLICATION_RECORD>, runReplicationOf<KIND_CSR, 1, REPLICATION_CONTROL>},
+         {runReplicationOf<KIND_CSR, 2, REPLICATION_PLAIN>, runReplicationOf<KIND_CSR, 2, REPLICATION_RECORD>, runReplicationOf<KIND_CSR, 2, REPLICATION_CONTROL>}},
+        {{runReplicationOf<KIND_CLIQUE, 1, REPLICATION_PLAIN>, runReplicationOf<KIND_CLIQUE, 1, REPLICATION_RECORD>, runReplicationOf<KIND_CLIQUE, 1, REPLICATION_CONTROL>},
+         {runReplicationOf<KIND_CLIQUE, 2, REPLICATION_PLAIN>, runReplicationOf<KIND_CLIQUE, 2, REPLICATION_RECORD>, runReplicationOf<KIND_CLIQUE, 2, REPLICATION_CONTROL>}},
+        {{runReplicationOf<KIND_STAR, 1, REPLICATION_PLAIN>, runReplicationOf<KIND_STAR, 1, REPLICATION_RECORD>, runReplicationOf<KIND_STAR, 1, REPLICATION_CONTROL>},
+         {runReplicationOf<KIND_STAR, 2, REPLICATION_PLAIN>, runReplicationOf<KIND_STAR, 2, REPLICATION_RECORD>, runReplicationOf<KIND_STAR, 2, REPLICATION_CONTROL>}},
+        {{runReplicationOf<KIND_CIRCULAR, 1, REPLICATION_PLAIN>, runReplicationOf<KIND_CIRCULAR, 1, REPLICATION_RECORD>, runReplicationOf<KIND_CIRCULAR, 1, REPLICATION_CONTROL>},
+         {runReplicationOf<KIND_CIRCULAR, 2, REPLICATION_PLAIN>, runReplicationOf<KIND_CIRCULAR, 2, REPLICATION_RECORD>, runReplicationOf<KIND_CIRCULAR, 2, REPLICATION_CONTROL>}}
+    };
+
+    return kernels[topology.kind()][parameters.infectionType == 1 ? 0 : 1][mode];
+}
+
+// Length of the next tau leap. The expected change in the number of
+// infected over the leap, and its standard deviation, are kept within the
+// tolerance times that number (and at least one node), so the rates barely
+// move during the leap. Infection rates so large that a node would almost
+// surely flip within a leap sized for the cures alone are capped, since a
+// leap gets those right however long it is.
+double tauLeapLength(double infectionRate, int infected, Data& parameters, double remaining) {
+    double cureRate = parameters.mu * infected;
+    double bound = max(parameters.tauTolerance * infected, 1.0);
+    double drift = fabs(infectionRate - cureRate);
+    double total = infectionRate + cureRate;
+    double tau = remaining;
+
+    if (drift > 0) {
+        tau = min(tau, bound / drift);
+    }
+    if (total > 0) {
+        tau = min(tau, bound * bound / total);
+    }
+
+    return tau;
+}
+
+double tauRateCap(Data& parameters) {
+    return TAU_SATURATION * parameters.mu / parameters.tauTolerance;
+}
+
+// Chance that a node which leaves its state at rate out, and returns to it
+// at rate back, is in the other state a time tau later. Counting the return
+// keeps a node that is cured and reinfected within one leap infected.
+double tauFlipProbability(double out, double back, double tau) {
+    if (out <= 0) {
+        return 0.0;
+    }
+    if (isinf(out)) {
+        return 1.0;
+    }
+    return out / (out + back) * -expm1(-(out + back) * tau);
+}
+
+// Approximate replication by tau leaping. Over each leap every node moves
+// as a two-state chain with the rates from the start of the leap, so only
+// the changes of its neighbors within the leap are missed. On the Clique
+// and the Star the state reduces to counts, so a leap is one binomial draw
+// per kind of node and a replication costs the same at any size. Other
+// topologies take one pass over the nodes per leap.
+int runTauReplication(Graph& graph, Data& parameters, RandomStream& rng, Profile* profile = NULL) {
+    const Topology& topology = *graph.topology;
+    int n = topology.size();
+    double lambda = parameters.C / n;
+    double maxTime = MAX_TIME * n;
+    double rateCap = tauRateCap(parameters);
+    double time = 0.0;
+    long long infections = 0, cures = 0;
+    int infected = 0;
+
+    if (topology.type == 1) {
+        while (time < maxTime) {
+            double rate = infectionRateFor(infected, lambda, parameters);
+            double reinfection = infectionRateFor(max(infected - 1, 0), lambda, parameters);
+            double tau = tauLeapLength((n - infected) * min(rate, rateCap), infected, parameters, maxTime - time);
+            long long newInfections = rng.binomial(n - infected, tauFlipProbability(rate, parameters.mu, tau));
+            long long newCures = rng.binomial(infected, tauFlipProbability(parameters.mu, reinfection, tau));
+
+            infected += newInfections - newCures;
+            infections += newInfections;
+            cures += newCures;
+            time += tau;
+        }
+    }
+    // The hub is a single node, so it is left out of the leap length and
+    // simply flips with its own probability.
+    else if (topology.type == 2) {
+        int hub = 0, leaves = 0;
+
+        while (time < maxTime) {
+            double leafRate = infectionRateFor(hub, lambda, parameters);
+            double hubRate = infectionRateFor(leaves, lambda, parameters);
+            double tau = tauLeapLength((n - 1 - leaves) * min(leafRate, rateCap), leaves, parameters, maxTime - time);
+            long long newInfections = rng.binomial(n - 1 - leaves, tauFlipProbability(leafRate, parameters.mu, tau));
+            long long newCures = rng.binomial(leaves, tauFlipProbability(parameters.mu, leafRate, tau));
+            bool hubFlips = rng.uniform() <= (hub == 1 ? tauFlipProbability(parameters.mu, hubRate, tau) :
+                    tauFlipProbability(hubRate, parameters.mu, tau));
+
+            leaves += newInfections - newCures;
+            infections += newInfections + (hubFlips && hub == 0);
+            cures += newCures + (hubFlips && hub == 1);
+            hub = hubFlips ? 1 - hub : hub;
+            time += tau;
+        }
+        infected = hub + leaves;
+    }
+    else {
+        vector<int> flips;
+
+        graph.reset(parameters);
+        while (time < maxTime) {
+            double infectionRate = 0.0;
+
+            for (int i = 0; i < n; i++) {
+                if (graph.status[i] == 0) {
+                    infectionRate += min(graph.nodeRate(i, parameters), rateCap);
+                }
+            }
+
+            double tau = tauLeapLength(infectionRate, infected, parameters, maxTime - time);
+
+            flips.clear();
+            for (int i = 0; i < n; i++) {
+                double rate = graph.infectionRateOf(i, parameters);
+                double p = graph.status[i] == 1 ? tauFlipProbability(parameters.mu, rate, tau) :
+                        tauFlipProbability(rate, parameters.mu, tau);
+
+                if (rng.uniform() <= p) {
+                    flips.push_back(i);
+                }
+            }
+            for (auto i : flips) {
+                if (graph.status[i] == 1) {
+                    graph.setStatus(i, 0, parameters);
+                    infected--;
+                    cures++;
+                }
+                else {
+                    graph.setStatus(i, 1, parameters);
+                    infected++;
+                    infections++;
+                }
+            }
+            time += tau;
+        }
+    }
+
+    if (profile != NULL) {
+        profile->infections += infections;
+        profile->cures += cures;
+        profile->replications++;
+    }
+
+    return infected;
+}
+
+// Runs replications [first, first + count) split across the worker threads.
+// The control variates of each one go to controls, CONTROL_VARIATES per
+// replication, when given.
+vector<int> runBatch(const Topology& topology, Data& parameters, unsigned masterSeed, int first, int count, Profile* profile,
+        vector<double>* controls = NULL) {
+    vector<int> result(count);
+    int nThreads = max(1, min(parameters.threads, count));
+    vector<Profile> workerProfile(nThreads);
+    vector<thread> workers;
+    ReplicationKernel runReplication = replicationKernel(topology, parameters, controls != NULL ? REPLICATION_CONTROL : REPLICATION_PLAIN);
+
+    if (controls != NULL) {
+        controls->assign(count * CONTROL_VARIATES, 0.0);
+    }
+
+    auto work = [&](int worker) {
+        Graph graph(topology);
+        Profile* replicationProfile = (profile != NULL) ? &workerProfile[worker] : NULL;
+
+        for (int i = worker; i < count; i += nThreads) {
+            RandomStream rng(parameters.generator, masterSeed, parameters.streamPopulation(topology.size()), first + i);
+
+            if (parameters.engine == 4) {
+                result[i] = runTauReplication(graph, parameters, rng, replicationProfile);
+                continue;
+            }
+            graph.reset(parameters);
+            result[i] = runReplication(graph, parameters, rng, NULL, replicationProfile, controls != NULL ? &(*controls)[i * CONTROL_VARIATES] : NULL);
+        }
+    };
+
+    if (nThreads == 1) {
+        work(0);
+    }
+    else {
+        for (int t = 0; t < nThreads; t++) {
+            workers.push_back(thread(work, t));
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    if (profile != NULL) {
+        for (auto& p : workerProfile) {
+            profile->merge(p);
+        }
+    }
+
+    return result;
+}
+
+struct PointResult {
+    int pop, replications;
+    double sampleMean, confidenceInterval, tConfidenceInterval;
+    bool done;
+    Profile profile;
+
+    // The exact engines' answer, for Tau Leaping points small enough to
+    // also run exactly.
+    bool hasReference;
+    double reference, referenceInterval;
+
+    PointResult(): pop(0), replications(0), sampleMean(0), confidenceInterval(0), tConfidenceInterval(0), done(false),
+            hasReference(false), reference(0), referenceInterval(0) {};
+    PointResult(int p): pop(p), replications(0), sampleMean(0), confidenceInterval(0), tConfidenceInterval(0), done(false),
+            hasReference(false), reference(0), referenceInterval(0) {};
+
+    // What a checkpoint or cache entry keeps of a finished point, on one line.
+    void write(ostream& out) const {
+        out << pop << " " << replications << " " << sampleMean << " " << confidenceInterval << " " << tConfidenceInterval << " ";
+        out << hasReference << " " << reference << " " << referenceInterval;
+    }
+
+    void read(istream& in) {
+        in >> pop >> replications >> sampleMean >> confidenceInterval >> tConfidenceInterval;
+        in >> hasReference >> reference >> referenceInterval;
+        done = true;
+    }
+};
+
+// Progress of one sweep, kept in <output file>.checkpoint so that a killed
+// run can pick up where it stopped. Replication r of a point always draws
+// from the stream seeded by (master seed, pop, r), so the statistics of a
+// point and its next replication number are all the state it needs, and
+// the resumed run writes the same rows an uninterrupted one would.
+//   PLAGCKP1
+//   <settings that change the results>
+//   seed <master seed>
+//   done <pop> <replications> <mean> <interval> <t interval> <has reference> <reference> <reference interval>
+//   partial <pop> <next replication> <count> <adjusted count> <adjusted mean> <adjusted m2> <means> <comoments>
+// where a point run without control variates has zero means and comoments.
+struct Checkpoint {
+    string fileName, settings;
+    unsigned masterSeed;
+    bool fixedSeed;
+    map<int, PointResult> done;
+    map<int, pair<int, ControlledStats> > partial;
+    double lastSave;
+    mutex lock;
+
+    Checkpoint(Data& parameters, unsigned seed, const string& suffix = ".checkpoint"): fileName(parameters.outputFileName + suffix),
+            settings(settingsOf(parameters)), masterSeed(seed), fixedSeed(parameters.seed != 0), lastSave(Profile::now()) {};
+
+    static string settingsOf(Data& parameters) {
+        ostringstream out;
+
+        out << setprecision(17) << parameters.gamma << " " << parameters.C << " " << parameters.mu << " ";
+        out << parameters.minPop << " " << parameters.maxPop << " " << parameters.increment << " " << parameters.pop << " ";
+        out << parameters.type << " " << parameters.infectionType << " " << parameters.confidence << " ";
+        out << parameters.engine << " " << parameters.estimator << " " << parameters.generator << " " << parameters.exact << " ";
+        out << parameters.tauTolerance << " " << parameters.varianceReduction << " " << parameters.graphSettings();
+
+        return out.str();
+    }
+
+    // Takes over the progress of a checkpoint left by a run with the same
+    // settings. A run on the clock seed also takes over its master seed, one
+    // with a seed of its own only resumes a checkpoint drawn from that seed.
+    // Returns false when there is none.
+    bool load() {
+        ifstream in(fileName);
+        string magic, line, kind;
+        unsigned savedSeed;
+
+        if (!getline(in, magic) || magic != CHECKPOINT_MAGIC || !getline(in, line) || line != settings) {
+            return false;
+        }
+        if (!(in >> kind >> savedSeed) || (fixedSeed && savedSeed != masterSeed)) {
+            return false;
+        }
+        masterSeed = savedSeed;
+        while (in >> kind) {
+            if (kind == "done") {
+                PointResult result;
+
+                result.read(in);
+                done[result.pop] = result;
+            }
+            else if (kind == "partial") {
+                int pop, next;
+                ControlledStats stats;
+
+                in >> pop >> next;
+                stats.read(in);
+                partial[pop] = make_pair(next, stats);
+            }
+        }
+
+        return !in.bad();
+    }
+
+    // Written aside and renamed over the old file, so a kill during the
+    // save leaves the previous checkpoint intact.
+    void save() {
+        string temporary = fileName + ".tmp";
+        ofstream out(temporary);
+
+        out << CHECKPOINT_MAGIC << endl << settings << endl;
+        out << "seed " << masterSeed << endl << setprecision(17);
+        for (auto& point : done) {
+            out << "done ";
+            point.second.write(out);
+            out << endl;
+        }
+        for (auto& point : partial) {
+            out << "partial " << point.first << " " << point.second.first << " ";
+            point.second.second.write(out);
+            out << endl;
+        }
+        out.close();
+
+        if (out) {
+            rename(temporary.c_str(), fileName.c_str());
+        }
+        lastSave = Profile::now();
+    }
+
+    // Saved at most every CHECKPOINT_SECONDS while a point is running.
+    void update(int pop, int next, const ControlledStats& stats) {
+        lock_guard<mutex> guard(lock);
+
+        partial[pop] = make_pair(next, stats);
+        if (Profile::now() - lastSave >= CHECKPOINT_SECONDS) {
+            save();
+        }
+    }
+
+    void finish(const PointResult& result) {
+        lock_guard<mutex> guard(lock);
+
+        done[result.pop] = result;
+        partial.erase(result.pop);
+        save();
+    }
+
+    // Where a point stopped, or false if it has not started.
+    bool resume(int pop, int& next, ControlledStats& stats) {
+        lock_guard<mutex> guard(lock);
+
+        if (partial.count(pop) == 0) {
+            return false;
+        }
+        next = partial[pop].first;
+        stats = partial[pop].second;
+        return true;
+    }
+
+    bool finished(int pop, PointResult& result) {
+        lock_guard<mutex> guard(lock);
+
+        if (done.count(pop) == 0) {
+            return false;
+        }
+        result = done[pop];
+        return true;
+    }
+};
+
+// 64-bit FNV-1a, continued from hash.
+uint64_t fnv1a(const char* data, size_t size, uint64_t hash = 14695981039346656037ULL) {
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ (unsigned char) data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+string hexOf(uint64_t hash) {
+    ostringstream out;
+
+    out << hex << setw(16) << setfill('0') << hash;
+    return out.str();
+}
+
+string fileDigest(const string& fileName) {
+    ifstream in(fileName, ios::binary);
+    vector<char> buffer(1 << 16);
+    uint64_t hash = fnv1a(NULL, 0);
+
+    while (in.read(&buffer[0], buffer.size()) || in.gcount() > 0) {
+        hash = fnv1a(&buffer[0], in.gcount(), hash);
+    }
+    return hexOf(hash);
+}
+
+// A finished point as the result cache keeps it: the result, the
+// confidence it was run to, and the master seed and statistics to carry
+// on from.
+struct CachedPoint {
+    unsigned masterSeed;
+    double confidence;
+    PointResult result;
+    int next;
+    ControlledStats stats;
+
+    CachedPoint(): masterSeed(0), confidence(0), next(1) {};
+};
+
+// Finished points kept across runs, one file per point in CACHE_DIRECTORY
+// named by a hash of everything its result depends on. The output file,
+// the other points of the sweep and the thread count are not part of it,
+// and a custom graph counts by its content rather than its file name.
+//   PLAGCCH1
+//   <key>
+//   seed <master seed> confidence <confidence>
+//   done <result>
+//   stats <next replication> <statistics>
+// A point asked for at a confidence the entry meets is served from it.
+// At a tighter one the Final Snapshot estimator carries on from the stored
+// statistics and master seed; the tighter target cannot be met before the
+// looser one was, so the result is the one a fresh run would give.
+struct ResultCache {
+    mutex lock;
+
+    static string keyOf(int pop, Data& parameters) {
+        ostringstream out;
+
+        out << setprecision(17) << pop << " " << parameters.gamma << " " << parameters.C << " " << parameters.mu << " ";
+        out << parameters.type << " " << parameters.infectionType << " " << parameters.engine << " " << parameters.estimator << " ";
+        out << parameters.generator << " " << parameters.exact << " " << parameters.tauTolerance << " ";
+        out << parameters.varianceReduction << " " << parameters.seed << " ";
+        out << (parameters.type == 4 ? fileDigest(parameters.inputFileName) : parameters.graphSettings());
+
+        return out.str();
+    }
+
+    static string fileOf(const string& key) {
+        return string(CACHE_DIRECTORY) + "/" + hexOf(fnv1a(key.data(), key.size())) + ".point";
+    }
+
+    bool load(const string& key, CachedPoint& point) {
+        ifstream in(fileOf(key));
+        string magic, line, word;
+
+        if (!getline(in, magic) || magic != CACHE_MAGIC || !getline(in, line) || line != key) {
+            return false;
+        }
+        in >> word >> point.masterSeed >> word >> point.confidence >> word;
+        point.result.read(in);
+        in >> word >> point.next;
+        point.stats.read(in);
+
+        if (in.fail()) {
+            point = CachedPoint();
+            return false;
+        }
+        return true;
+    }
+
+    // Written aside and renamed, like a checkpoint, under a name of its own
+    // for each process, so runs sharing the directory do not collide.
+    void store(const string& key, const CachedPoint& point) {
+        lock_guard<mutex> guard(lock);
+        string fileName = fileOf(key);
+        string temporary = fileName + "." + to_string(getpid()) + ".tmp";
+
+        mkdir(CACHE_DIRECTORY, 0755);
+        ofstream out(temporary);
+
+        out << CACHE_MAGIC << endl << key << endl << setprecision(17);
+        out << "seed " << point.masterSeed << " confidence " << point.confidence << endl;
+        out << "done ";
+        point.result.write(out);
+        out << endl << "stats " << point.next << " ";
+        point.stats.write(out);
+        out << endl;
+        out.close();
+
+        if (out) {
+            rename(temporary.c_str(), fileName.c_str());
+        }
+        else {
+            remove(temporary.c_str());
+        }
+    }
+};
+
+// Batch means over a single long run. The first warm-up period is dropped,
+// then the time integral of the infected count over each batch gives one
+// sample. When consecutive batch means are still correlated, pairs of
+// batches are merged and later batches are twice as long.
+template <int Kind, int Infection>
+PointResult runTimeAverageOf(const Topology& topology, Data& parameters, unsigned masterSeed, bool verbose) {
+    int pop = topology.size();
+    PointResult result(pop);
+    Graph graph(topology);
+    RandomStream rng(parameters.generator, masterSeed, parameters.streamPopulation(pop), 0);
+    double warmup = MAX_TIME / parameters.mu;
+    double batchLength = MAX_TIME / parameters.mu;
+    double batchStart = warmup, area = 0.0;
+    vector<double> batchMeans;
+    SampleStats nInfected;
+    bool converged = false;
+
+    graph.reset(parameters);
+    Simulation<Kind, Infection> simulation(graph, parameters.profile ? &result.profile : NULL);
+
+    while (!converged) {
+        bool moreEvents = simulation.next(parameters, rng);
+        double eventTime = moreEvents ? simulation.pending.eventTime : INFINITY;
+
+        while (!converged && eventTime >= batchStart + batchLength) {
+            area += simulation.infected * (batchStart + batchLength - max(simulation.time, batchStart));
+            batchMeans.push_back(area / batchLength);
+            nInfected.add(batchMeans.back());
+            result.profile.replications++;
+            area = 0.0;
+            batchStart += batchLength;
+
+            if (verbose) {
+                cout << "\r" << "Running batch number " << batchMeans.size() << " for population size " << pop << "..." << flush;
+            }
+
+            int nBatches = batchMeans.size();
+            if (nBatches < MIN_ITERATIONS) {
+                continue;
+            }
+
+            double lag1 = 0.0;
+            for (int i = 1; i < nBatches; i++) {
+                lag1 += (batchMeans[i] - nInfected.mean) * (batchMeans[i - 1] - nInfected.mean);
+            }
+            lag1 /= nInfected.m2;
+
+            if (lag1 > BATCH_MAX_CORRELATION && nBatches % 2 == 0) {
+                nInfected = SampleStats();
+                for (int i = 0; i < nBatches / 2; i++) {
+                    batchMeans[i] = (batchMeans[2*i] + batchMeans[2*i + 1]) / 2;
+                    nInfected.add(batchMeans[i]);
+                }
+                batchMeans.resize(nBatches / 2);
+                batchLength *= 2;
+            }
+            else if (lag1 <= BATCH_MAX_CORRELATION && !(nInfected.confidenceInterval() / nInfected.mean > parameters.confidence)) {
+                converged = true;
+            }
+        }
+
+        if (converged) {
+            break;
+        }
+        if (!moreEvents) {
+            // Nothing can ever change, so the current state is the average.
+            nInfected = SampleStats();
+            nInfected.add(simulation.infected);
+            break;
+        }
+
+        if (eventTime > batchStart) {
+            area += simulation.infected * (eventTime - max(simulation.time, batchStart));
+        }
+        simulation.apply(parameters, rng);
+    }
+
+    result.replications = nInfected.count;
+    result.sampleMean = nInfected.mean;
+    result.confidenceInterval = nInfected.confidenceInterval();
+    result.tConfidenceInterval = nInfected.tConfidenceInterval();
+    result.done = true;
+
+    return result;
+}
+
+PointResult runTimeAverage(const Topology& topology, Data& parameters, unsigned masterSeed, bool verbose) {
+    typedef PointResult (*TimeAverageKernel)(const Topology&, Data&, unsigned, bool);
+    static const TimeAverageKernel kernels[KERNEL_KINDS][2] = {
+        {runTimeAverageOf<KIND_CSR, 1>, runTimeAverageOf<KIND_CSR, 2>},
+        {runTimeAverageOf<KIND_CLIQUE, 1>, runTimeAverageOf<KIND_CLIQUE, 2>},
+        {runTimeAverageOf<KIND_STAR, 1>, runTimeAverageOf<KIND_STAR, 2>},
+        {runTimeAverageOf<KIND_CIRCULAR, 1>, runTimeAverageOf<KIND_CIRCULAR, 2>}
+    };
+
+    return kernels[topology.kind()][parameters.infectionType == 1 ? 0 : 1](topology, parameters, masterSeed, verbose);
+}
+
+// Runs replications for one population size until the confidence rule holds.
+PointResult runPoint(const Topology& topology, Data& parameters, unsigned masterSeed, bool verbose, Checkpoint* checkpoint = NULL,
+        ResultCache* cache = NULL) {
+    int pop = topology.size();
+    PointResult result(pop);
+    int curSim = 1;
+    bool converged = false;
+    ControlledStats nInfected;
+    vector<double> controls;
+    double start = Profile::now();
+    Profile* profile = parameters.profile ? &result.profile : NULL;
+    string key;
+    CachedPoint cached;
+
+    auto confident = [&]() {
+        return curSim > MIN_ITERATIONS && !(nInfected.adjusted.confidenceInterval() / nInfected.adjusted.mean > parameters.confidence);
+    };
+
+    if (parameters.exact && exactExpectedInfected(pop, parameters, result.sampleMean, &topology)) {
+        result.done = true;
+        return result;
+    }
+    if (cache != NULL) {
+        key = ResultCache::keyOf(pop, parameters);
+        if (cache->load(key, cached) && cached.confidence <= parameters.confidence) {
+            if (verbose) {
+                cout << "Population size " << pop << " taken from the result cache." << endl;
+            }
+            return cached.result;
+        }
+    }
+    if (parameters.estimator == 2) {
+        result = runTimeAverage(topology, parameters, masterSeed, verbose);
+        result.profile.wallSeconds = Profile::now() - start;
+        if (cache != NULL) {
+            cached = CachedPoint();
+            cached.masterSeed = masterSeed;
+            cached.confidence = parameters.confidence;
+            cached.result = result;
+            cache->store(key, cached);
+        }
+        return result;
+    }
+    if (checkpoint != NULL && checkpoint->resume(pop, curSim, nInfected)) {
+        if (verbose) {
+            cout << "Resuming population size " << pop << " after " << nInfected.count << " replications." << endl;
+        }
+    }
+    else if (cached.next > 1) {
+        masterSeed = cached.masterSeed;
+        curSim = cached.next;
+        nInfected = cached.stats;
+        if (verbose) {
+            cout << "Refining population size " << pop << " from " << nInfected.count << " cached replications." << endl;
+        }
+        // A fresh run at this confidence may already have stopped there.
+        converged = confident();
+    }
+
+    while (!converged) {
+        int batchSize = parameters.threads * REPLICATION_BATCH;
+
+        if (verbose) {
+            cout << "\r" << "Running simulation number " << curSim + batchSize - 1 << " for population size " << pop << "..." << flush; 
+        }
+
+        // The stopping rule is checked after every replication in order,
+        // so replications past the stopping point in a batch are dropped
+        // and the result is the same for any number of threads.
+        vector<int> numberOfInfected = runBatch(topology, parameters, masterSeed, curSim - 1, batchSize, profile,
+                parameters.controlVariate() ? &controls : NULL);
+
+        for (int i = 0; i < batchSize; i++) {
+            nInfected.add(numberOfInfected[i], controls.empty() ? NULL : &controls[i * CONTROL_VARIATES]);
+
+            curSim++;
+
+            if (confident()) {
+                converged = true;
+                break;
+            }
+        }
+
+        if (checkpoint != NULL && !converged) {
+            checkpoint->update(pop, curSim, nInfected);
+        }
+    }
+
+    result.replications = nInfected.count;
+    result.sampleMean = nInfected.adjusted.mean;
+    result.confidenceInterval = nInfected.adjusted.confidenceInterval();
+    result.tConfidenceInterval = nInfected.adjusted.tConfidenceInterval();
+    result.profile.wallSeconds = Profile::now() - start;
+    result.done = true;
+
+    if (parameters.engine == 4 && pop <= TAU_CHECK_MAX_POP) {
+        Data exactParameters = parameters;
+
+        exactParameters.engine = 2;
+        exactParameters.profile = false;
+        result.hasReference = true;
+        if (!exactExpectedInfected(pop, exactParameters, result.reference, &topology)) {
+            PointResult exact = runPoint(topology, exactParameters, masterSeed, false);
+
+            result.reference = exact.sampleMean;
+            result.referenceInterval = exact.confidenceInterval;
+        }
+    }
+
+    if (cache != NULL) {
+        cached.masterSeed = masterSeed;
+        cached.confidence = parameters.confidence;
+        cached.result = result;
+        cached.next = curSim;
+        cached.stats = nInfected;
+        cache->store(key, cached);
+    }
+
+    return result;
+}
+
+void writePoint(PointResult& result, ostream& out, bool verbose) {
+    int pop = result.pop;
+    double sampleMean = result.sampleMean;
+    double confidenceInterval = result.confidenceInterval;
+    double infectedProbability = (sampleMean/pop) * 100;
+
+    if (verbose) {
+        cout << endl;
+        cout << "Average number of infected for " << pop << " nodes is " << sampleMean << "." << endl;
+        cout << "Probability of a node being infected is " << infectedProbability << "%" << endl;
+        cout << "Confidence Interval is [" << sampleMean - confidenceInterval << ", " << sampleMean + confidenceInterval << "]" << endl;
+        if (result.replications > 1) {
+            double tInterval = result.tConfidenceInterval;
+            cout << "Student t Confidence Interval is [" << sampleMean - tInterval << ", " << sampleMean + tInterval << "]";
+            cout << " over " << result.replications << " replications" << endl;
+        }
+        if (result.hasReference) {
+            cout << "Tau leaping error is " << sampleMean - result.reference << " against " << result.reference;
+            cout << (result.referenceInterval > 0 ? " from the Incremental engine" : " from the exact solver") << endl;
+        }
+        //cout << "Confidence percentage is " << confidenceInterval / sampleMean << endl;
+        cout << endl;
+    }
+
+    #ifndef VALIDATION_FLAG
+    out << pop << " " << fixed << setprecision(5) << sampleMean/pop << endl;
+    #else
+    out << pop << " " << sampleMean-confidenceInterval << " " << sampleMean+confidenceInterval << endl;
+    #endif
+}
+
+long peakMemoryKB() {
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// One row of the performance report, and its summary on the console. The
+// memory is the process's high-water mark so far, so it also covers earlier
+// jobs and the points that ran alongside this one.
+void writeProfile(PointResult& result, ostream& out, bool verbose) {
+    Profile& profile = result.profile;
+    long long events = profile.infections + profile.cures;
+    double eventsPerSecond = (profile.wallSeconds > 0) ? events / profile.wallSeconds : 0.0;
+    long peakKB = peakMemoryKB();
+
+    if (verbose) {
+        cout << "Performance: " << events << " events (" << profile.infections << " infections, ";
+        cout << profile.cures << " cures) in " << profile.wallSeconds << "s, " << eventsPerSecond << " events/s" << endl;
+        cout << "Time spent: " << profile.selectSeconds << "s selecting events, " << profile.updateSeconds << "s updating rates, ";
+        cout << profile.cureSeconds << "s on cures, " << profile.outputSeconds << "s writing output" << endl;
+        cout << "Replications: " << result.replications << " needed, " << profile.replications << " run. ";
+        cout << "Peak memory of the process so far: " << peakKB << " KB" << endl << endl;
     }
 
-    return newParam;
+    out << result.pop << "," << result.replications << "," << profile.replications << ",";
+    out << profile.infections << "," << profile.cures << "," << eventsPerSecond << ",";
+    out << profile.selectSeconds << "," << profile.updateSeconds << "," << profile.cureSeconds << ",";
+    out << profile.outputSeconds << "," << profile.wallSeconds << "," << peakKB << endl;
+}
+
+void writeProfileHeader(ostream& out) {
+    out << "pop,replications,replications_run,infections,cures,events_per_sec,";
+    out << "select_s,update_s,cure_s,output_s,wall_s,cumulative_peak_rss_kb" << endl;
+}
+
+// How far Tau Leaping is from the exact engines, on the sizes where both
+// ran. The error is significant when it is larger than both intervals
+// together, and than rounding in the exact solver.
+void writeTauError(PointResult& result, ostream& out) {
+    double error = result.sampleMean - result.reference;
+    double interval = result.confidenceInterval + result.referenceInterval;
+
+    out << result.pop << "," << result.sampleMean << "," << result.reference << "," << error << ",";
+    out << (result.reference != 0 ? error / result.reference : 0.0) << "," << interval << ",";
+    out << (fabs(error) > max(interval, 1e-6 * result.reference) ? 1 : 0) << endl;
 }
 
-bool eventSort(Event a, Event b) {
-    return (a.eventTime < b.eventTime);
+void writeTauErrorHeader(ostream& out) {
+    out << "pop,tau_mean,exact_mean,error,relative_error,combined_interval,significant" << endl;
 }
 
-double calculateSampleMean(vector<int> nInfected) {
-    double sampleMean = 0.0;
+vector<int> sweepPopulations(Data& parameters) {
+    vector<int> populations;
 
-    for (auto value : nInfected) {
-        sampleMean += value;
+    if (parameters.type == 4) {
+        populations.push_back(parameters.pop);
+        return populations;
+    }
+    for (int pop = parameters.minPop; pop <= parameters.maxPop; pop += parameters.increment) {
+        populations.push_back(pop);
     }
-    sampleMean /= nInfected.size();
 
-    return sampleMean;
+    return populations;
 }
 
-double calculateSampleVariance(vector<int> nInfected, double sampleMean) {
-    double sampleVariance = 0.0;
+// Topologies shared by every sweep point and job that asks for the same
+// graph type, size and graph settings. The points are counted up front
+// with want(), and a topology is let go of once the last point counted for
+// it has taken it, so only those of points still to run are kept. A
+// topology is built outside the lock by the first point that asks for it,
+// and the others wait on its future, so unrelated builds run in parallel.
+struct TopologyCache {
+    map<string, shared_future<shared_ptr<Topology> > > topology;
+    map<string, int> pending;
+    mutex lock;
+
+    // The Full Scan engine's topologies carry bit rows, so they are kept
+    // apart from the others'.
+    static string keyOf(int n, Data& parameters) {
+        return to_string(parameters.type) + " " + to_string(n) + " " + parameters.graphSettings() +
+                (parameters.engine == 1 ? " rows" : "");
+    }
+
+    void want(int n, Data& parameters) {
+        lock_guard<mutex> guard(lock);
+
+        pending[keyOf(n, parameters)]++;
+    }
+
+    shared_ptr<Topology> get(int n, Data& parameters) {
+        string key = keyOf(n, parameters);
+        promise<shared_ptr<Topology> > built;
+        shared_future<shared_ptr<Topology> > result;
+        bool build = false;
+
+        {
+            lock_guard<mutex> guard(lock);
+
+            if (topology.count(key) == 0) {
+                topology[key] = built.get_future().share();
+                build = true;
+            }
+            result = topology[key];
+            drop(key);
+        }
+        if (build) {
+            built.set_value(make_shared<Topology>(n, parameters));
+        }
+
+        return result.get();
+    }
+
+    // For a counted point that does not need its topology after all.
+    void skip(int n, Data& parameters) {
+        lock_guard<mutex> guard(lock);
+
+        drop(keyOf(n, parameters));
+    }
+
+    // Called with lock held.
+    void drop(const string& key) {
+        if (--pending[key] <= 0) {
+            pending.erase(key);
+            topology.erase(key);
+        }
+    }
+};
+
+// One sweep and the stream its rows go to, in ascending population order.
+struct Job {
+    Data parameters;
+    string error;
+    vector<int> populations;
+    vector<PointResult> results;
+    unsigned nextOutput;
+    ostream* out;
+    ostream* profileOut;
+    bool verbose;
+
+    Checkpoint* checkpoint;
+    ostream* tauErrorOut;
+
+    Job(Data p, ostream& o, bool v, ostream* po = NULL): parameters(p), populations(sweepPopulations(p)),
+            results(populations.size()), nextOutput(0), out(&o), profileOut(po), verbose(v),
+            checkpoint(NULL), tauErrorOut(NULL) {};
+
+    bool finished() const {
+        return !error.empty() || nextOutput == results.size();
+    }
+};
+
+// Keeps the points of shard i of k: the points of all jobs are counted in
+// job file order and every k-th one from the i-th on is kept.
+void shardJobs(vector<Job>& jobs, int shard, int shards) {
+    int point = 0;
 
-    for (auto value : nInfected) {
-        sampleVariance += pow((value - sampleMean), 2);
+    for (auto& job : jobs) {
+        vector<int> kept;
+
+        for (auto pop : job.populations) {
+            if (point++ % shards == shard) {
+                kept.push_back(pop);
+            }
+        }
+        job.populations = kept;
+        job.results = vector<PointResult>(kept.size());
     }
-    sampleVariance /= (nInfected.size() - 1);
+}
 
-    return sampleVariance;
+string shardSuffix(int shard, int shards) {
+    return ".shard" + to_string(shard) + "of" + to_string(shards);
 }
 
-void runSimulation(Data parameters) {
-    Graph graph;
-    vector<Event> cureList;
+// Runs every population point of every job on a pool of worker threads.
+// Points are independent, so with several workers they are handed out
+// largest first, since those dominate the run time, and the threads left
+// over go to the replications of each point. Each job's rows are written
+// as soon as all of its smaller populations have finished.
+void runJobs(vector<Job>& jobs, int threads, TopologyCache& cache) {
+    vector<pair<int, int> > tasks;
+    vector<thread> workers;
+    mutex jobLock;
+    unsigned nextTask = 0;
+    ResultCache resultCache;
 
-    for (int pop = parameters.minPop; pop <= parameters.maxPop; pop += parameters.increment) {
-        int curSim = 1;
-        double sampleMean, sampleVariance, confidenceInterval;
-        vector<int> nInfected;
+    for (unsigned j = 0; j < jobs.size(); j++) {
+        for (unsigned point = 0; point < jobs[j].populations.size(); point++) {
+            tasks.push_back(make_pair(j, point));
+            cache.want(jobs[j].populations[point], jobs[j].parameters);
+        }
+    }
+
+    int nWorkers = max(1, min(threads, (int) tasks.size()));
+    if (nWorkers > 1) {
+        stable_sort(tasks.begin(), tasks.end(), [&](const pair<int, int>& a, const pair<int, int>& b) {
+            return jobs[a.first].populations[a.second] > jobs[b.first].populations[b.second];
+        });
+    }
 
-        if (parameters.type == 4) {
-            pop = parameters.pop;
+    // Writes the rows of a job that are ready. Called with jobLock held.
+    auto flush = [&](int j) {
+        Job& job = jobs[j];
+        bool wrote = false;
+
+        while (job.error.empty() && job.nextOutput < job.results.size() && job.results[job.nextOutput].done) {
+            PointResult& written = job.results[job.nextOutput];
+            double start = Profile::now();
+
+            writePoint(written, *job.out, job.verbose);
+            if (job.profileOut != NULL) {
+                written.profile.outputSeconds += Profile::now() - start;
+                writeProfile(written, *job.profileOut, job.verbose);
+            }
+            if (job.tauErrorOut != NULL && written.hasReference) {
+                writeTauError(written, *job.tauErrorOut);
+            }
+            job.nextOutput++;
+            wrote = true;
         }
-        if (parameters.hack) {
-            outputFile << "Population " << pop << endl;
+        if (!job.verbose && wrote && job.finished()) {
+            cout << "Finished job " << j + 1 << ", saved at " << job.parameters.outputFileName << "." << endl;
         }
+    };
 
-        do {
-            graph = Graph(pop, parameters);
-            double simulationTime = 0.0;
-            vector<Event> cures;
-
-            cout << "\r" << "Running simulation number " << curSim << " for population size " << pop << "..." << flush; 
-
-            //for (int count = 0; count < MAX_ITERATIONS * pop; count++) {
-            //double maxTime = (1.0 * pop)/((parameters.C / pop) + parameters.gamma + parameters.mu);
-            double maxTime = MAX_TIME * pop;
-            while (simulationTime < maxTime) {
-                Event nextInfection = graph.findNextInfection(parameters);
-
-                if (nextInfection.node != -1) {
-                    if (cures.size() == 0) {
-                        simulationTime += nextInfection.eventTime;
-                        if (simulationTime > maxTime) {
-                            break;
-                        }
-                        graph.node[nextInfection.node].status = 1;
-                        exponential_distribution<double> cureTime(parameters.mu);
-                        cures.push_back(Event(nextInfection.node, cureTime(randomGen)));
-                        sort(cures.begin(), cures.end(), eventSort);
+    // Takes a point finished before a checkpoint.
+    auto restore = [&](int j, int point) {
+        PointResult result;
 
-                        //cout << "(" << simulationTime << "t) Node " << nextInfection.node << " has been infected." << endl;
-                    }
-                    else {
-                        if (cures[0].eventTime > nextInfection.eventTime) {
-                            simulationTime += nextInfection.eventTime;
-                            if (simulationTime > maxTime) {
-                                break;
-                            }
-                            graph.node[nextInfection.node].status = 1;
-                            for (unsigned int i = 0; i < cures.size(); i++) {
-                                cures[i].eventTime -= nextInfection.eventTime;
-                            }
-                            exponential_distribution<double> cureTime(parameters.mu);
-                            cures.push_back(Event(nextInfection.node, cureTime(randomGen)));
-                            sort(cures.begin(), cures.end(), eventSort);
-
-                            //cout << "(" << simulationTime << "t) Node " << nextInfection.node << " has been infected." << endl;
-                        }
-                        else {
-                            simulationTime += cures[0].eventTime;
-                            if (simulationTime > maxTime) {
-                                break;
-                            }
-
-                            //cout << "(" << simulationTime << "t) Node " << cures[0].node << " has been healed." << endl;
-
-                            graph.node[cures[0].node].status = 0;
-                            for (unsigned int i = 1; i < cures.size(); i++) {
-                                cures[i].eventTime -= cures[0].eventTime;
-                            }
-                            cures.erase(cures.begin());
-                        }
-                    }
-                }
-                else {
-                    simulationTime += cures[0].eventTime;
-                    if (simulationTime > maxTime) {
-                        break;
-                    }
+        if (jobs[j].checkpoint == NULL || !jobs[j].checkpoint->finished(jobs[j].populations[point], result)) {
+            return false;
+        }
 
-                    //cout << "(" << simulationTime << "t) Node " << cures[0].node << " has been healed." << endl;
+        lock_guard<mutex> guard(jobLock);
+        jobs[j].results[point] = result;
+        flush(j);
+        return true;
+    };
 
-                    graph.node[cures[0].node].status = 0;
-                    for (unsigned int i = 1; i < cures.size(); i++) {
-                        cures[i].eventTime -= cures[0].eventTime;
-                    }
-                    cures.erase(cures.begin());
+    auto work = [&]() {
+        while (true) {
+            pair<int, int> task;
+            {
+                lock_guard<mutex> guard(jobLock);
+                if (nextTask == tasks.size()) {
+                    return;
                 }
+                task = tasks[nextTask++];
+            }
 
-                /*cout << "------------------------" << endl;
-                cout << "Currently infected nodes:" << endl;
-                for (unsigned int i = 0; i < cures.size(); i++) {
-                    cout << cures[i].node << " will be healed in " << cures[i].eventTime << "." << endl;
-                }
-                cout << "------------------------" << endl;*/
+            Job& job = jobs[task.first];
+            Data pointParameters = job.parameters;
+            unsigned masterSeed = pointParameters.seed != 0 ? pointParameters.seed : seed;
+            int pop = job.populations[task.second];
+            int pointThreads = max(1, threads / nWorkers);
+            bool verbose = job.verbose && nWorkers == 1;
 
-                if (parameters.hack) {
-                    int hackedInfected = 0;
+            if (job.checkpoint != NULL) {
+                masterSeed = job.checkpoint->masterSeed;
+            }
+            if (restore(task.first, task.second)) {
+                cache.skip(pop, pointParameters);
+                continue;
+            }
 
-                    for (unsigned int i = 0; i < graph.node.size(); i++) {
-                        if (graph.node[i].status == 1) {
-                            hackedInfected++;
-                        }
-                    }
+            shared_ptr<Topology> topology = cache.get(pop, pointParameters);
 
-                    outputFile << simulationTime << " " << hackedInfected << endl;
-                }
+            if (!topology->error.empty()) {
+                lock_guard<mutex> guard(jobLock);
+                job.error = topology->error;
+                continue;
             }
 
-            int numberOfInfected = 0;
-            for (unsigned int i = 0; i < graph.node.size(); i++) {
-                if (graph.node[i].status == 1) {
-                    numberOfInfected++;
-                }
+            pointParameters.threads = pointThreads;
+            PointResult result = runPoint(*topology, pointParameters, masterSeed, verbose, job.checkpoint,
+                    pointParameters.resultCache ? &resultCache : NULL);
+
+            if (job.checkpoint != NULL) {
+                job.checkpoint->finish(result);
             }
-            nInfected.push_back(numberOfInfected);
 
-            sampleMean = calculateSampleMean(nInfected);
-            sampleVariance = calculateSampleVariance(nInfected, sampleMean);
-            confidenceInterval = (2 * 1.96 * sqrt(sampleVariance)) / (sqrt(nInfected.size()));
+            lock_guard<mutex> guard(jobLock);
+            job.results[task.second] = result;
+            flush(task.first);
+        }
+    };
 
-            curSim++;
+    if (nWorkers == 1) {
+        work();
+        return;
+    }
+
+    cout << "Running " << tasks.size() << " population sizes on " << nWorkers << " threads..." << endl;
+    for (int t = 0; t < nWorkers; t++) {
+        workers.push_back(thread(work));
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+// Gives a job its checkpoint, taking over the progress a run with the same
+// settings left behind. The file is removed once the sweep is complete.
+// A shard always has one, under the shard's suffix, and keeps it as its
+// partial result file.
+shared_ptr<Checkpoint> openCheckpoint(Job& job, const string& shardFile = "") {
+    Data& parameters = job.parameters;
+    shared_ptr<Checkpoint> checkpoint;
+
+    if (!parameters.checkpoint && shardFile.empty()) {
+        return checkpoint;
+    }
+
+    checkpoint = make_shared<Checkpoint>(parameters, parameters.seed != 0 ? parameters.seed : seed,
+            shardFile.empty() ? ".checkpoint" : shardFile);
+    if (checkpoint->load()) {
+        cout << "Resuming " << parameters.outputFileName << " from " << checkpoint->fileName << ", ";
+        cout << checkpoint->done.size() << " of " << job.populations.size() << " population sizes done." << endl;
+    }
+    if (!shardFile.empty()) {
+        checkpoint->save();
+    }
+    job.checkpoint = checkpoint.get();
+
+    return checkpoint;
+}
+
+void closeCheckpoint(Job& job) {
+    if (job.checkpoint != NULL && job.error.empty() && job.finished()) {
+        remove(job.checkpoint->fileName.c_str());
+    }
+}
 
-            if (parameters.hack) {
+void runSimulation(Data parameters) {
+    unsigned masterSeed = parameters.seed != 0 ? parameters.seed : seed;
+
+    // The time series mode records one trajectory per population size
+    // while it simulates, so it stays in order.
+    if (parameters.hack) {
+        TrajectoryRecorder recorder(outputFile, parameters);
+
+        for (auto pop : sweepPopulations(parameters)) {
+            Topology topology(pop, parameters);
+
+            if (!topology.error.empty()) {
+                cout << "Could not load the graph: " << topology.error << "." << endl;
                 break;
             }
 
-        } while (curSim <= MIN_ITERATIONS || confidenceInterval / sampleMean > parameters.confidence);
-        
-        double infectedProbability = (sampleMean/pop) * 100;
+            Graph graph(topology);
+            RandomStream rng(parameters.generator, masterSeed, pop, 0);
 
-        if (!parameters.hack) {
-            cout << endl;
-            cout << "Average number of infected for " << pop << " nodes is " << sampleMean << "." << endl;
-            cout << "Probability of a node being infected is " << infectedProbability << "%" << endl;
-            cout << "Confidence Interval is [" << sampleMean - confidenceInterval << ", " << sampleMean + confidenceInterval << "]" << endl;
-            //cout << "Confidence percentage is " << confidenceInterval / sampleMean << endl;
-            cout << endl;
+            cout << "\r" << "Recording a trajectory for population size " << pop << "..." << flush;
+            graph.reset(parameters);
+            recorder.beginPopulation(pop);
+            replicationKernel(topology, parameters, REPLICATION_RECORD)(graph, parameters, rng, &recorder, NULL, NULL);
+        }
+    }
+    else {
+        TopologyCache cache;
+        ofstream profileFile;
 
-            #ifndef VALIDATION_FLAG
-            outputFile << pop << " " << fixed << setprecision(5) << sampleMean/pop << endl;
-            #else
-            outputFile << pop << " " << sampleMean-confidenceInterval << " " << sampleMean+confidenceInterval << endl;
-            #endif
+        if (parameters.profile) {
+            profileFile.open("profile_" + parameters.outputFileName);
+            writeProfileHeader(profileFile);
         }
-        else {
-            outputFile << endl;
+
+        vector<Job> jobs(1, Job(parameters, outputFile, true, parameters.profile ? &profileFile : NULL));
+        shared_ptr<Checkpoint> checkpoint = openCheckpoint(jobs[0]);
+        ofstream tauErrorFile;
+
+        if (parameters.engine == 4) {
+            tauErrorFile.open("tau_error_" + parameters.outputFileName);
+            writeTauErrorHeader(tauErrorFile);
+            jobs[0].tauErrorOut = &tauErrorFile;
         }
 
-        if (parameters.type == 4) {
-            break;
+        runJobs(jobs, parameters.threads, cache);
+        closeCheckpoint(jobs[0]);
+        if (!jobs[0].error.empty()) {
+            cout << "Could not load the graph: " << jobs[0].error << "." << endl;
         }
     }
 
@@ -580,6 +3761,64 @@ void readParameters(Data& parameters) {
         iParamFile >> parameters.confidence;
         iParamFile >> parameters.outputFileName;
         iParamFile >> parameters.mainParameter;
+
+        // Settings added after the original format are optional, so older
+        // files keep their defaults.
+        int engine, threads;
+        unsigned seed;
+        bool exact;
+        int estimator, trajectoryFormat, trajectoryDecimation;
+        double trajectoryInterval;
+        int generator;
+        bool profile, checkpoint;
+        double tauTolerance, rewiring;
+        int graphDegree;
+        unsigned graphSeed;
+        int varianceReduction;
+        bool resultCache;
+        if (iParamFile >> engine) {
+            parameters.engine = engine;
+        }
+        if (iParamFile >> threads) {
+            parameters.threads = threads;
+        }
+        if (iParamFile >> seed) {
+            parameters.seed = seed;
+        }
+        if (iParamFile >> exact) {
+            parameters.exact = exact;
+        }
+        if (iParamFile >> estimator) {
+            parameters.estimator = estimator;
+        }
+        if (iParamFile >> trajectoryFormat >> trajectoryInterval >> trajectoryDecimation) {
+            parameters.trajectoryFormat = trajectoryFormat;
+            parameters.trajectoryInterval = trajectoryInterval;
+            parameters.trajectoryDecimation = trajectoryDecimation;
+        }
+        if (iParamFile >> generator) {
+            parameters.generator = generator;
+        }
+        if (iParamFile >> profile) {
+            parameters.profile = profile;
+        }
+        if (iParamFile >> checkpoint) {
+            parameters.checkpoint = checkpoint;
+        }
+        if (iParamFile >> tauTolerance) {
+            parameters.tauTolerance = tauTolerance;
+        }
+        if (iParamFile >> graphDegree >> rewiring >> graphSeed) {
+            parameters.graphDegree = graphDegree;
+            parameters.rewiring = rewiring;
+            parameters.graphSeed = graphSeed;
+        }
+        if (iParamFile >> varianceReduction) {
+            parameters.varianceReduction = varianceReduction;
+        }
+        if (iParamFile >> resultCache) {
+            parameters.resultCache = resultCache;
+        }
     }
     iParamFile.close();
 }
@@ -601,34 +3840,480 @@ void saveParameters(Data& parameters) {
     oParamFile << parameters.confidence << endl;
     oParamFile << parameters.outputFileName << endl;
     oParamFile << parameters.mainParameter << endl;
+    oParamFile << parameters.engine << endl;
+    oParamFile << parameters.threads << endl;
+    oParamFile << parameters.seed << endl;
+    oParamFile << parameters.exact << endl;
+    oParamFile << parameters.estimator << endl;
+    oParamFile << parameters.trajectoryFormat << endl;
+    oParamFile << parameters.trajectoryInterval << endl;
+    oParamFile << parameters.trajectoryDecimation << endl;
+    oParamFile << parameters.generator << endl;
+    oParamFile << parameters.profile << endl;
+    oParamFile << parameters.checkpoint << endl;
+    oParamFile << parameters.tauTolerance << endl;
+    oParamFile << parameters.graphDegree << endl;
+    oParamFile << parameters.rewiring << endl;
+    oParamFile << parameters.graphSeed << endl;
+    oParamFile << parameters.varianceReduction << endl;
+    oParamFile << parameters.resultCache << endl;
     oParamFile.close();
 }
 
-void writeMainParameter(Data parameters) {
-    outputFile << parameters.printMainParameter() << " ";
-    if (parameters.mainParameter == 1) {
-        outputFile << parameters.gamma;
+// Sets one setting from its name in job files. Returns false for unknown
+// names or values that do not parse.
+bool setParameter(Data& parameters, const string& key, const string& value) {
+    istringstream in(value);
+    bool valid = true;
+
+    if (key == "gamma") {
+        in >> parameters.gamma;
     }
-    else if (parameters.mainParameter == 2) {
-        outputFile << parameters.mu;
+    else if (key == "C") {
+        in >> parameters.C;
     }
-    else if (parameters.mainParameter == 3) {
-        outputFile << parameters.C;
+    else if (key == "mu") {
+        in >> parameters.mu;
+    }
+    else if (key == "minPop") {
+        in >> parameters.minPop;
     }
-    outputFile << endl;
+    else if (key == "maxPop") {
+        in >> parameters.maxPop;
+    }
+    else if (key == "increment") {
+        in >> parameters.increment;
+    }
+    else if (key == "input") {
+        in >> parameters.inputFileName;
+    }
+    else if (key == "pop") {
+        in >> parameters.pop;
+    }
+    else if (key == "type") {
+        in >> parameters.type;
+        valid = parameters.type >= 1 && parameters.type <= 8;
+    }
+    else if (key == "infectionType") {
+        in >> parameters.infectionType;
+        valid = parameters.infectionType >= 1 && parameters.infectionType <= 2;
+    }
+    else if (key == "confidence") {
+        in >> parameters.confidence;
+    }
+    else if (key == "output") {
+        in >> parameters.outputFileName;
+    }
+    else if (key == "mainParameter") {
+        in >> parameters.mainParameter;
+        valid = parameters.mainParameter >= 1 && parameters.mainParameter <= 3;
+    }
+    else if (key == "engine") {
+        in >> parameters.engine;
+        valid = parameters.engine >= 1 && parameters.engine <= 4 && parameters.engine != 3;
+    }
+    else if (key == "threads") {
+        in >> parameters.threads;
+        valid = parameters.threads >= 1;
+    }
+    else if (key == "seed") {
+        in >> parameters.seed;
+    }
+    else if (key == "exact") {
+        in >> parameters.exact;
+    }
+    else if (key == "estimator") {
+        in >> parameters.estimator;
+        valid = parameters.estimator >= 1 && parameters.estimator <= 2;
+    }
+    else if (key == "generator") {
+        in >> parameters.generator;
+        valid = parameters.generator >= 1 && parameters.generator <= 2;
+    }
+    else if (key == "profile") {
+        in >> parameters.profile;
+    }
+    else if (key == "checkpoint") {
+        in >> parameters.checkpoint;
+    }
+    else if (key == "tolerance") {
+        in >> parameters.tauTolerance;
+    }
+    else if (key == "degree") {
+        in >> parameters.graphDegree;
+        valid = parameters.graphDegree >= 1;
+    }
+    else if (key == "rewiring") {
+        in >> parameters.rewiring;
+    }
+    else if (key == "graphSeed") {
+        in >> parameters.graphSeed;
+    }
+    else if (key == "variance") {
+        in >> parameters.varianceReduction;
+        valid = parameters.varianceReduction >= 1 && parameters.varianceReduction <= 4;
+    }
+    else if (key == "cache") {
+        in >> parameters.resultCache;
+    }
+    else {
+        return false;
+    }
+
+    return !in.fail() && valid;
+}
+
+// A job file holds one job per line, as space separated key=value settings
+// on top of parameters.cfg, e.g. "gamma=1.2 type=2 output=star.csv". Blank
+// lines and lines starting with # are skipped. Jobs without an output
+// setting are saved as job<number>_<output file>.
+bool readJobFile(const string& fileName, Data& base, vector<Data>& jobs) {
+    ifstream jobFile(fileName);
+    string line;
+    int lineNumber = 0;
+
+    if (!jobFile) {
+        cout << "Could not open " << fileName << "." << endl;
+        return false;
+    }
+
+    while (getline(jobFile, line)) {
+        istringstream tokens(line);
+        string token;
+        Data job = base;
+        bool hasOutput = false;
+
+        lineNumber++;
+        if (!(tokens >> token) || token[0] == '#') {
+            continue;
+        }
+
+        do {
+            size_t equals = token.find('=');
+
+            if (equals == string::npos || !setParameter(job, token.substr(0, equals), token.substr(equals + 1))) {
+                cout << fileName << ":" << lineNumber << ": invalid setting " << token << "." << endl;
+                return false;
+            }
+            hasOutput = hasOutput || token.substr(0, equals) == "output";
+        } while (tokens >> token);
+
+        if (job.type != 4 && (job.minPop < 1 || job.minPop > job.maxPop || job.increment < 1)) {
+            cout << fileName << ":" << lineNumber << ": invalid setting minPop=" << job.minPop << " maxPop=" << job.maxPop;
+            cout << " increment=" << job.increment << "." << endl;
+            return false;
+        }
+        if (!hasOutput) {
+            job.outputFileName = "job" + to_string(jobs.size() + 1) + "_" + base.outputFileName;
+        }
+        jobs.push_back(job);
+    }
+
+    return true;
+}
+
+// Headless mode: runs every job of a job file in one process, sharing
+// topologies between jobs and scheduling all points on one thread pool.
+// As shard i of k it only runs the points shardJobs keeps, and instead of
+// the outputs writes each job's partial result file, <output>.shard<i>of<k>,
+// for mergeJobFile. Shards need a fixed seed, so that every process draws
+// the streams a single run would.
+int runJobFile(const string& fileName, Data& base, int shard = 0, int shards = 1) {
+    vector<Data> parameters;
+    vector<Job> jobs;
+    TopologyCache cache;
+    string suffix = (shards > 1) ? shardSuffix(shard, shards) : "";
+    ostream discard(NULL);
+    int failed = 0;
+
+    if (!readJobFile(fileName, base, parameters)) {
+        return 1;
+    }
+
+    vector<ofstream> outputs(parameters.size());
+    vector<ofstream> profiles(parameters.size());
+    for (unsigned j = 0; j < parameters.size(); j++) {
+        if (shards > 1 && parameters[j].seed == 0) {
+            cout << "Job " << j + 1 << " has no seed; sharded jobs need a fixed seed." << endl;
+            return 1;
+        }
+        if (shards == 1) {
+            outputs[j].open(parameters[j].outputFileName);
+            writeMainParameter(parameters[j], outputs[j]);
+        }
+        if (parameters[j].profile) {
+            profiles[j].open("profile_" + parameters[j].outputFileName + suffix);
+            writeProfileHeader(profiles[j]);
+        }
+        jobs.push_back(Job(parameters[j], shards == 1 ? outputs[j] : discard, false, parameters[j].profile ? &profiles[j] : NULL));
+    }
+    if (shards > 1) {
+        shardJobs(jobs, shard, shards);
+    }
+
+    vector<shared_ptr<Checkpoint> > checkpoints;
+    vector<ofstream> tauErrors(parameters.size());
+    for (unsigned j = 0; j < jobs.size(); j++) {
+        checkpoints.push_back(openCheckpoint(jobs[j], suffix));
+        if (parameters[j].engine == 4) {
+            tauErrors[j].open("tau_error_" + parameters[j].outputFileName + suffix);
+            writeTauErrorHeader(tauErrors[j]);
+            jobs[j].tauErrorOut = &tauErrors[j];
+        }
+    }
+
+    runJobs(jobs, base.threads, cache);
+    for (auto& job : jobs) {
+        if (shards == 1) {
+            closeCheckpoint(job);
+        }
+    }
+
+    for (unsigned j = 0; j < jobs.size(); j++) {
+        if (!jobs[j].error.empty()) {
+            cout << "Job " << j + 1 << " failed: " << jobs[j].error << "." << endl;
+            failed++;
+        }
+    }
+    cout << jobs.size() - failed << " of " << jobs.size() << " jobs finished." << endl;
+
+    return failed == 0 ? 0 : 1;
+}
+
+// Writes the outputs of a job file from the partial result files of its
+// shards 0 to shards - 1. The points come out in population order with the
+// same rows a single run writes. A job fails when a shard file is missing,
+// was run with other settings or a different job file, or when a point is
+// in none of them.
+int mergeJobFile(const string& fileName, Data& base, int shards) {
+    vector<Data> parameters;
+    int failed = 0;
+
+    if (!readJobFile(fileName, base, parameters)) {
+        return 1;
+    }
+
+    for (unsigned j = 0; j < parameters.size(); j++) {
+        Data& job = parameters[j];
+        map<int, PointResult> done;
+        string error;
+
+        for (int shard = 0; shard < shards && error.empty(); shard++) {
+            Checkpoint partial(job, job.seed, shardSuffix(shard, shards));
+
+            if (!partial.load() || partial.masterSeed != job.seed) {
+                error = partial.fileName + " is missing or from other settings";
+            }
+            done.insert(partial.done.begin(), partial.done.end());
+        }
+        for (auto pop : sweepPopulations(job)) {
+            if (error.empty() && done.count(pop) == 0) {
+                error = "population size " + to_string(pop) + " is in no shard";
+            }
+        }
+        if (!error.empty()) {
+            cout << "Job " << j + 1 << " failed: " << error << "." << endl;
+            failed++;
+            continue;
+        }
+
+        ofstream out(job.outputFileName);
+        ofstream tauError;
+
+        writeMainParameter(job, out);
+        if (job.engine == 4) {
+            tauError.open("tau_error_" + job.outputFileName);
+            writeTauErrorHeader(tauError);
+        }
+        for (auto pop : sweepPopulations(job)) {
+            writePoint(done[pop], out, false);
+            if (job.engine == 4 && done[pop].hasReference) {
+                writeTauError(done[pop], tauError);
+            }
+        }
+    }
+    cout << parameters.size() - failed << " of " << parameters.size() << " jobs merged." << endl;
+
+    return failed == 0 ? 0 : 1;
+}
+
+// A random undirected graph with the given average degree, for benchmarks.
+shared_ptr<Topology> benchmarkCustomGraph(int n, int degree, unsigned graphSeed) {
+    RandomStream rng(2, graphSeed, n, 0);
+    vector<unsigned int> src, dst;
+    long long nEdges = (long long) n * degree / 2;
+
+    for (long long e = 0; e < nEdges; e++) {
+        unsigned int a = rng.next64() % n;
+        unsigned int b = rng.next64() % n;
+
+        if (a != b) {
+            src.push_back(a);
+            dst.push_back(b);
+            src.push_back(b);
+            dst.push_back(a);
+        }
+    }
+
+    return make_shared<Topology>(n, src, dst, vector<int>(src.size(), 1));
+}
+
+// The number of events in one replication up to BENCH_TIME.
+template <int Kind, int Infection>
+long long runBenchReplicationOf(Graph& graph, Data& parameters, RandomStream& rng) {
+    Simulation<Kind, Infection> simulation(graph);
+    long long events = 0;
+
+    while (simulation.next(parameters, rng) && simulation.pending.eventTime <= BENCH_TIME) {
+        simulation.apply(parameters, rng);
+        events++;
+    }
+
+    return events;
+}
+
+// The workload of one benchmark case, fixed here rather than read from
+// parameters.cfg so that rows stay comparable between machines and releases.
+struct BenchCase {
+    int type, infectionType, engine, generator;
+    double gamma, C, mu;
+    int sizes[3];
+};
+
+// Fixed-seed, fixed-horizon runs of every graph type and infection type.
+// Each case repeats replications for at least BENCH_SECONDS and prints one
+// CSV row, so results can be diffed and tracked between releases. The peak
+// memory is the process's so far, so it only grows from row to row.
+int runBenchmark() {
+    static const BenchCase cases[] = {
+        {1, 1, 2, 2, 1.1, 10.0, 1.0, {100, 300, 1000}},
+        {1, 2, 2, 2, 1.1, 10.0, 1.0, {100, 300, 1000}},
+        {2, 1, 2, 2, 1.1, 10.0, 1.0, {1000, 10000, 100000}},
+        {2, 2, 2, 2, 1.1, 10.0, 1.0, {1000, 10000, 100000}},
+        {3, 1, 2, 2, 1.1, 10.0, 1.0, {1000, 10000, 100000}},
+        {3, 2, 2, 2, 1.1, 10.0, 1.0, {1000, 10000, 100000}},
+        {4, 1, 2, 2, 1.1, 10.0, 1.0, {1000, 10000, 100000}},
+        {4, 2, 2, 2, 1.1, 10.0, 1.0, {1000, 10000, 100000}}
+    };
+    typedef long long (*BenchKernel)(Graph&, Data&, RandomStream&);
+    static const BenchKernel kernels[KERNEL_KINDS][2] = {
+        {runBenchReplicationOf<KIND_CSR, 1>, runBenchReplicationOf<KIND_CSR, 2>},
+        {runBenchReplicationOf<KIND_CLIQUE, 1>, runBenchReplicationOf<KIND_CLIQUE, 2>},
+        {runBenchReplicationOf<KIND_STAR, 1>, runBenchReplicationOf<KIND_STAR, 2>},
+        {runBenchReplicationOf<KIND_CIRCULAR, 1>, runBenchReplicationOf<KIND_CIRCULAR, 2>}
+    };
+
+    cout << "graph,infection,engine,generator,gamma,C,mu,n,replications,events,seconds,events_per_sec,ns_per_event,";
+    cout << "replications_per_sec,cumulative_peak_rss_kb" << endl;
+
+    for (const BenchCase& benchCase : cases) {
+        for (int n : benchCase.sizes) {
+            Data benchParameters;
+            shared_ptr<Topology> topology;
+
+            benchParameters.seed = 1;
+            benchParameters.type = benchCase.type;
+            benchParameters.infectionType = benchCase.infectionType;
+            benchParameters.engine = benchCase.engine;
+            benchParameters.generator = benchCase.generator;
+            benchParameters.gamma = benchCase.gamma;
+            benchParameters.C = benchCase.C;
+            benchParameters.mu = benchCase.mu;
+            if (benchCase.type == 4) {
+                topology = benchmarkCustomGraph(n, BENCH_DEGREE, benchParameters.seed);
+            }
+            else {
+                topology = make_shared<Topology>(n, benchParameters);
+            }
+
+            Graph graph(*topology);
+            BenchKernel runReplication = kernels[topology->kind()][benchCase.infectionType - 1];
+            long long events = 0;
+            int replications = 0;
+            double seconds = 0.0;
+            auto start = chrono::steady_clock::now();
+
+            while (seconds < BENCH_SECONDS) {
+                RandomStream rng(benchParameters.generator, benchParameters.seed, n, replications);
+
+                graph.reset(benchParameters);
+                events += runReplication(graph, benchParameters, rng);
+
+                replications++;
+                seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            }
+
+            cout << benchParameters.printGraphType() << "," << benchParameters.printInfectionType() << ",";
+            cout << benchParameters.printEngine() << "," << benchParameters.printGenerator() << ",";
+            cout << benchParameters.gamma << "," << benchParameters.C << "," << benchParameters.mu << ",";
+            cout << n << "," << replications << "," << events << "," << seconds << ",";
+            cout << events / seconds << "," << 1e9 * seconds / max(events, 1LL) << ",";
+            cout << replications / seconds << "," << peakMemoryKB() << endl;
+        }
+    }
+
+    return 0;
 }
 
-int main () {
+int main(int argc, char* argv[]) {
     Data parameters;
+    string jobFileName;
+    int shard = 0, shards = 1, merge = 0;
 
     readParameters(parameters);
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+
+        if (arg == "--jobs" && i + 1 < argc) {
+            jobFileName = argv[++i];
+        }
+        else if (arg == "--bench") {
+            return runBenchmark();
+        }
+        else if (arg == "--threads" && i + 1 < argc) {
+            parameters.threads = max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--shard" && i + 1 < argc) {
+            istringstream in(argv[++i]);
+            char slash = 0;
+
+            in >> shard >> slash >> shards;
+            if (slash != '/' || shards < 1 || shard < 0 || shard >= shards) {
+                cout << "Invalid shard " << argv[i] << ", expected I/K with 0 <= I < K." << endl;
+                return 1;
+            }
+        }
+        else if (arg == "--merge" && i + 1 < argc) {
+            merge = atoi(argv[++i]);
+            if (merge < 1) {
+                cout << "Invalid shard count " << argv[i] << "." << endl;
+                return 1;
+            }
+        }
+        else {
+            cout << "Usage: " << argv[0] << " [--jobs FILE [--shard I/K | --merge K]] [--threads N] [--bench]" << endl;
+            return 1;
+        }
+    }
+    if ((shards > 1 || merge != 0) && jobFileName.empty()) {
+        cout << "Sharding needs a job file." << endl;
+        return 1;
+    }
+    if (merge != 0) {
+        return mergeJobFile(jobFileName, parameters, merge);
+    }
+    if (!jobFileName.empty()) {
+        return runJobFile(jobFileName, parameters, shard, shards);
+    }
+
     parameters = runUI(parameters);
     saveParameters(parameters);
 
     while (parameters.run) {
-        outputFile.open(parameters.outputFileName);
+        outputFile.open(parameters.outputFileName, ios::out | ios::binary);
         if (!parameters.hack) {
-            writeMainParameter(parameters);
+            writeMainParameter(parameters, outputFile);
         }
         runSimulation(parameters);
         outputFile.close();